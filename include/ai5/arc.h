@@ -20,17 +20,34 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #include "nulib.h"
-#include "nulib/hashtable.h"
 #include "nulib/string.h"
 #include "nulib/vector.h"
 
-declare_hashtable_string_type(arcindex, int);
+struct archive_prefetch;
+struct archive_stream;
+struct archive_uring;
+struct thread_pool;
 
 enum {
-	ARCHIVE_MMAP = 1, // map archive in memory
-	ARCHIVE_RAW  = 2, // skip decompression when loading files
+	ARCHIVE_MMAP       = 1,  // map archive in memory
+	ARCHIVE_RAW        = 2,  // skip decompression when loading files
+	ARCHIVE_THREADSAFE = 4,  // allow concurrent access from multiple threads
+	// access pattern hints (see `archive_advise`)
+	ARCHIVE_SEQUENTIAL = 8,  // entries will be read in offset order
+	ARCHIVE_RANDOM     = 16, // entries will be read in no particular order
+	ARCHIVE_WILLNEED   = 32, // start reading the whole archive in the background
+	ARCHIVE_POPULATE   = 64, // prefault the mapping when opening (with ARCHIVE_MMAP)
+};
+
+enum archive_file_type {
+	ARCHIVE_FILE_OTHER,
+	ARCHIVE_FILE_MES,  // .MES
+	ARCHIVE_FILE_CG,   // .GP4, .GP8, .G16, .G24, .G32, .PNG
+	ARCHIVE_FILE_ANIM, // .S4
+	ARCHIVE_FILE_A6,   // .A6
 };
 
 struct arc_metadata {
@@ -42,12 +59,70 @@ struct arc_metadata {
 	uint8_t name_key;
 };
 
+struct archive_index_bucket {
+	uint32_t entry; // entry index + 1, or 0 if empty
+	uint32_t name;  // offset of the entry's name in `names`
+};
+
 struct archive {
-	hashtable_t(arcindex) index;
+	// name lookup table (open addressing). This replaces the nulib hashtable
+	// (`hashtable_t(arcindex)`) which used to be exposed here; use
+	// `archive_get_index` or `archive_key` to look up names.
+	struct {
+		struct archive_index_bucket *buckets;
+		uint32_t nr_buckets; // power of two
+	} index;
 	vector_t(struct archive_data) files;
+	// storage for all entry names (in the sidecar index, if one is used)
+	struct {
+		char *data;
+		size_t size;
+	} names;
 	struct arc_metadata meta;
-	unsigned flags;
+	unsigned flags; // as given when opened; not modified afterwards
+	unsigned hints; // current access pattern hints (written under `lock`)
 	bool mapped;
+	bool borrowed; // `map` is caller-owned memory (see `archive_open_mem`)
+	// protects entry refcounts/flags when ARCHIVE_THREADSAFE is set
+	pthread_mutex_t lock;
+	// signalled when an entry finishes loading
+	pthread_cond_t loaded;
+	// serializes seek+read pairs where pread is unavailable (Windows)
+	pthread_mutex_t io_lock;
+	// prebuilt index (see `archive_open_indexed`)
+	struct {
+		uint8_t *data;
+		size_t size;
+	} sidecar;
+	// cache of released entries (see `archive_set_cache_size`)
+	struct {
+		size_t max_bytes;
+		size_t bytes;
+		uint32_t *prev; // LRU links, indexed by entry
+		uint32_t *next;
+		uint32_t head;  // most recently released entry
+		uint32_t tail;  // least recently released entry
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+	} cache;
+	// I/O and decompression statistics (see `archive_get_stats`)
+	struct {
+		uint64_t loads;
+		uint64_t mapped_loads;
+		uint64_t file_loads;
+		uint64_t bytes_read;
+		uint64_t bytes_decompressed;
+		uint64_t read_ns;
+		uint64_t decompress_ns;
+		uint64_t resident_bytes;
+		uint64_t peak_resident_bytes;
+	} stats;
+	// worker threads for background loads
+	struct thread_pool *pool;
+	// ring for batched reads (Linux only; created on first use)
+	struct archive_uring *uring;
+	bool uring_unavailable;
 	union {
 		FILE *fp;
 		struct {
@@ -61,12 +136,25 @@ struct archive_data {
 	uint32_t offset;
 	uint32_t raw_size; // size of file in archive
 	uint32_t size;     // size of data in `data` (uncompressed)
-	string name;
+	// UTF-8 name. This used to be a nulib `string`; it is now a plain C
+	// string pointing into the archive's name storage (or sidecar index),
+	// so it must not be modified or passed to `string_*` functions.
+	const char *name;
 	uint8_t *data;
+	// Load state. Only accessed with the archive lock held.
 	unsigned int ref : 16;      // reference count
 	unsigned int mapped : 1;    // true if `data` is a pointer into mmapped region
+	unsigned int loading : 1;   // true while data is being loaded by some thread
+	unsigned int cached : 1;    // true if released but kept in the archive's cache
+	// The zero-width bit-field puts the fields below in a separate memory
+	// location: they are set when the entry is created and read without the
+	// lock, which would race with updates to the load state if they shared
+	// storage with it.
+	unsigned int : 0;
 	unsigned int allocated : 1; // true if archive_data object needs to be freed
-	unsigned int reserved : 14; // reserved for future flags
+	unsigned int compressed : 1; // true if stored LZSS-compressed (by file type)
+	unsigned int type : 3;      // enum archive_file_type
+	unsigned int cg_type : 3;   // enum cg_type (if `type` is ARCHIVE_FILE_CG)
 	struct archive *archive;
 };
 
@@ -78,14 +166,108 @@ void archive_close(struct archive *arc)
 
 /*
  * Open an archive.
+ *
+ * If `ARCHIVE_THREADSAFE` is given in `flags`, then `archive_get`,
+ * `archive_get_by_index`, `archive_data_load` and `archive_data_release` may
+ * be called concurrently from any number of threads.
  */
 struct archive *archive_open(const char *path, unsigned flags)
 	attr_dealloc(archive_close, 1)
 	attr_nonnull;
 
+/*
+ * Open an archive using the prebuilt index at `index_path`. If the index is
+ * missing or stale (the archive's size or modification time changed), the
+ * archive index is read as usual and the prebuilt index is (re)written.
+ *
+ * The contents of an index that matches the archive are trusted, so the
+ * index must not be modified by anything other than this function.
+ * Failure to write the index is not an error.
+ */
+struct archive *archive_open_indexed(const char *path, const char *index_path,
+		unsigned flags)
+	attr_dealloc(archive_close, 1)
+	attr_nonnull;
+
+/*
+ * Open an archive from an open file descriptor. The archive takes ownership
+ * of `fd`, which is closed by `archive_close` (or immediately on failure).
+ */
+struct archive *archive_open_fd(int fd, unsigned flags)
+	attr_dealloc(archive_close, 1);
+
+/*
+ * Open an archive stored in memory. The memory is not copied and must remain
+ * valid (and unmodified) until the archive is closed. Loaded entries which
+ * don't need decompression point directly into `data`.
+ */
+struct archive *archive_open_mem(const uint8_t *data, size_t size, unsigned flags)
+	attr_dealloc(archive_close, 1)
+	attr_nonnull;
+
+/*
+ * Set the access pattern hints for an archive (any of `ARCHIVE_SEQUENTIAL`,
+ * `ARCHIVE_RANDOM` and `ARCHIVE_WILLNEED`), replacing the hints given when it
+ * was opened. The hints are passed on to the OS (madvise/posix_fadvise) where
+ * supported and are otherwise ignored.
+ */
+void archive_advise(struct archive *arc, unsigned hints)
+	attr_nonnull;
+
+struct archive_cache_stats {
+	uint64_t hits;      // loads satisfied from the cache
+	uint64_t misses;    // loads that read the entry from the archive
+	uint64_t evictions; // entries freed to stay within the budget
+	size_t bytes;       // bytes currently held by the cache
+	size_t max_bytes;
+};
+
+/*
+ * Set the byte budget for the cache of released entries. Entries whose
+ * reference count drops to zero are kept loaded (up to `max_bytes` in total)
+ * and the least recently released entries are evicted first. Entries that
+ * point directly into an mmapped archive are never cached.
+ *
+ * The cache is disabled by default; a budget of zero disables it again.
+ */
+void archive_set_cache_size(struct archive *arc, size_t max_bytes)
+	attr_nonnull;
+
+/*
+ * Get cache hit/miss/eviction counters.
+ */
+void archive_get_cache_stats(struct archive *arc, struct archive_cache_stats *out)
+	attr_nonnull;
+
+struct archive_stats {
+	uint64_t loads;               // entries loaded from the archive (not the cache)
+	uint64_t mapped_loads;        // ...of which were served from the mapping
+	uint64_t file_loads;          // ...of which were read from the file
+	uint64_t bytes_read;          // raw bytes read from the file
+	uint64_t bytes_decompressed;  // bytes produced by LZSS decompression
+	uint64_t read_ns;             // time spent reading from the file
+	uint64_t decompress_ns;       // time spent in LZSS decompression
+	uint64_t resident_bytes;      // heap bytes held by loaded and cached entries
+	uint64_t peak_resident_bytes; // high-water mark of `resident_bytes`
+};
+
+/*
+ * Get I/O and decompression counters. The counters are cheap to maintain and
+ * are always enabled. Times are wall-clock time summed over all threads.
+ */
+void archive_get_stats(struct archive *arc, struct archive_stats *out)
+	attr_nonnull;
+
+/*
+ * Reset the counters returned by `archive_get_stats`. The peak resident size
+ * is reset to the current resident size.
+ */
+void archive_reset_stats(struct archive *arc)
+	attr_nonnull;
+
 /*
  * Release a reference to an entry. If the reference count becomes zero, the
- * loaded data is free'd.
+ * loaded data is free'd (unless it is kept by the cache).
  */
 void archive_data_release(struct archive_data *data)
 	attr_nonnull;
@@ -101,12 +283,64 @@ struct archive_data *archive_get(struct archive *arc, const char *name)
 struct archive_data *archive_get_by_index(struct archive *arc, unsigned i)
 	attr_nonnull;
 
+/*
+ * Get several entries at once. Entries are read in archive order, and
+ * entries that are close together in the archive are read with a single
+ * read. On return, out[i] is the entry for names[i] (the caller owns a
+ * reference to it), or NULL if the entry was not found or failed to load.
+ *
+ * Returns false if any entry could not be loaded.
+ */
+bool archive_get_many(struct archive *arc, const char * const *names, unsigned n,
+		struct archive_data **out)
+	attr_nonnull;
+
+/*
+ * Like `archive_get_many`, but with entries given by index.
+ */
+bool archive_get_many_by_index(struct archive *arc, const unsigned *indices, unsigned n,
+		struct archive_data **out)
+	attr_nonnull;
+
 /*
  * Get the index of an entry by name.
  */
 int archive_get_index(struct archive *arc, const char *name)
 	attr_nonnull;
 
+/*
+ * A resolved entry name. Keys are valid for the lifetime of the archive they
+ * were obtained from, and fetching an entry by key skips case folding, hashing
+ * and the table lookup entirely.
+ */
+typedef uint32_t archive_key_t;
+#define ARCHIVE_KEY_NONE 0
+
+/*
+ * Resolve an entry name to a key. Returns ARCHIVE_KEY_NONE if the archive
+ * contains no entry with the given name.
+ */
+archive_key_t archive_key(struct archive *arc, const char *name)
+	attr_nonnull;
+
+/*
+ * Resolve several names at once. The lookups of a batch of names are
+ * interleaved, so that their memory accesses overlap. On return, out[i] is the
+ * key for names[i] (or ARCHIVE_KEY_NONE).
+ *
+ * Returns false if any name was not found.
+ */
+bool archive_key_many(struct archive *arc, const char * const *names, unsigned n,
+		archive_key_t *out)
+	attr_nonnull;
+
+/*
+ * Get an entry by key. Like `archive_get`, the entry is loaded and the caller
+ * owns a reference to it when this function returns.
+ */
+struct archive_data *archive_get_by_key(struct archive *arc, archive_key_t key)
+	attr_nonnull;
+
 /*
  * Load data for an entry (if it is not already loaded). The caller owns a
  * reference to the entry when this function returns.
@@ -118,6 +352,212 @@ bool archive_data_load(struct archive_data *data)
 	attr_warn_unused_result
 	attr_nonnull;
 
+enum {
+	ARCHIVE_EXTRACT_CONVERT_CG = 1, // write CGs as PNG
+};
+
+/*
+ * Filter for `archive_extract_all`. Returns true if the entry should be
+ * extracted.
+ */
+typedef bool (*archive_extract_filter)(struct archive_data *data, void *user);
+
+/*
+ * Extract all entries accepted by `filter` (or all entries, if `filter` is
+ * NULL) to files in the existing directory `dest_dir`. Entries are read in
+ * archive order, while decompression, conversion and writing are spread over
+ * `nr_threads` threads (one per CPU if 0). The archive's entries are not
+ * loaded and its access pattern hints are not changed, so this may be used
+ * while other entries are held (or, with ARCHIVE_THREADSAFE, while other
+ * threads use the archive).
+ *
+ * Only the first of several entries with the same name is extracted, and
+ * likewise for entries written to the same file (ignoring case, e.g. "X.G24"
+ * and "X.GP8" with ARCHIVE_EXTRACT_CONVERT_CG); the others are skipped with a
+ * warning and count as failures. Entries whose names are not plain file names
+ * (e.g. containing path separators or "..") are skipped and count as failures.
+ *
+ * Returns false if any entry could not be extracted.
+ */
+bool archive_extract_all(struct archive *arc, const char *dest_dir, unsigned nr_threads,
+		archive_extract_filter filter, void *user, unsigned flags);
+
+enum {
+	// hash decompressed data instead of the data as stored in the archive
+	ARCHIVE_MANIFEST_DECOMPRESSED = 1,
+};
+
+struct archive_manifest_entry {
+	char *name;    // name in the archive (UTF-8)
+	uint64_t hash; // 64-bit content hash (XXH64)
+	uint32_t size; // size of the hashed data
+};
+
+/*
+ * The content hashes of the entries in an archive, sorted by name.
+ */
+struct archive_manifest {
+	unsigned flags;
+	unsigned nr_entries;
+	struct archive_manifest_entry *entries;
+};
+
+/*
+ * Free a manifest.
+ */
+void archive_manifest_free(struct archive_manifest *m)
+	attr_nonnull;
+
+/*
+ * Compute the manifest of an archive. Entries are hashed on `nr_threads`
+ * threads (one per CPU if 0), directly from the mapping if the archive is
+ * mmapped. As with lookups, only the first of several entries with the same
+ * name is included.
+ */
+struct archive_manifest *archive_manifest_new(struct archive *arc, unsigned nr_threads,
+		unsigned flags)
+	attr_dealloc(archive_manifest_free, 1)
+	attr_nonnull;
+
+/*
+ * Read a manifest written by `archive_manifest_save`.
+ */
+struct archive_manifest *archive_manifest_load(const char *path)
+	attr_dealloc(archive_manifest_free, 1)
+	attr_nonnull;
+
+/*
+ * Write a manifest to a text file, one "<hash> <size> <name>" line per entry.
+ */
+bool archive_manifest_save(struct archive_manifest *m, const char *path)
+	attr_nonnull;
+
+enum archive_change_type {
+	ARCHIVE_CHANGE_ADDED,
+	ARCHIVE_CHANGE_MODIFIED,
+	ARCHIVE_CHANGE_REMOVED,
+};
+
+struct archive_change {
+	enum archive_change_type type;
+	const char *name; // points into one of the manifests
+};
+
+/*
+ * Compare two manifests computed with the same flags. On success, `*changes`
+ * is set to a malloc'd array (in name order) of the differences going from
+ * `old` to `new`, and `*nr_changes` to its length.
+ */
+bool archive_manifest_diff(struct archive_manifest *old, struct archive_manifest *new,
+		struct archive_change **changes, unsigned *nr_changes)
+	attr_nonnull;
+
+/*
+ * Create a patch archive at `path` holding the entries of `arc` that were
+ * added or modified relative to the manifest `base`. Entries are copied as
+ * stored, without being recompressed. Removed entries can't be expressed in
+ * an archive and are ignored; load the patch over the original (e.g. with
+ * `vfs_add_archive`) to apply it.
+ *
+ * Archives can't hold fewer than two entries, so if only one entry changed an
+ * unchanged entry is included alongside it, or an empty "PATCH.PAD" entry if
+ * the archive has no other entry. If nothing changed, no file is written and
+ * `*nr_changed` (if not NULL) is set to zero.
+ */
+bool archive_create_patch(struct archive *arc, struct archive_manifest *base,
+		const char *path, unsigned nr_threads, unsigned *nr_changed);
+
+/*
+ * Close a stream.
+ */
+void archive_stream_close(struct archive_stream *s)
+	attr_nonnull;
+
+/*
+ * Open a streaming reader for an entry. Data is read from the archive and
+ * decompressed incrementally, so an entry can be processed in constant memory
+ * without loading it. The entry's reference count is not affected.
+ *
+ * Entries that don't belong to an archive (loose files returned by `vfs_get`)
+ * are streamed from their loaded data, so the caller must hold a reference to
+ * them for the lifetime of the stream.
+ */
+struct archive_stream *archive_data_open_stream(struct archive_data *data)
+	attr_dealloc(archive_stream_close, 1)
+	attr_nonnull;
+
+/*
+ * Read up to `n` bytes of (decompressed) data from a stream. Returns the
+ * number of bytes read, which is less than `n` only at the end of the entry
+ * or on error.
+ */
+size_t archive_stream_read(struct archive_stream *s, void *out, size_t n)
+	attr_nonnull;
+
+/*
+ * Check whether a read error occurred on a stream.
+ */
+bool archive_stream_error(struct archive_stream *s)
+	attr_nonnull;
+
+/*
+ * Load a set of entries on background threads. The returned handle owns a
+ * reference to each entry that was loaded successfully, so that subsequent
+ * calls to `archive_get` for those entries return immediately.
+ *
+ * The references are dropped by `archive_prefetch_free` (after which entries
+ * remain resident only if the archive's cache has room for them).
+ *
+ * The archive must have been opened with `ARCHIVE_THREADSAFE`, since the
+ * caller may use it while the loads are running; otherwise NULL is returned.
+ */
+struct archive_prefetch *archive_prefetch(struct archive *arc, const char * const *names,
+		unsigned n)
+	attr_nonnull;
+
+/*
+ * Check whether all loads for a prefetch have completed, without blocking.
+ */
+bool archive_prefetch_done(struct archive_prefetch *p)
+	attr_nonnull;
+
+/*
+ * Wait for all loads for a prefetch to complete. Returns false if any of the
+ * entries were not found or failed to load.
+ */
+bool archive_prefetch_wait(struct archive_prefetch *p)
+	attr_nonnull;
+
+/*
+ * Wait for a prefetch to complete and release its references.
+ */
+void archive_prefetch_free(struct archive_prefetch *p)
+	attr_nonnull;
+
+struct archive_create_entry {
+	const char *name; // name in the archive (UTF-8)
+	const char *path; // file to read the data from
+	// if not NULL, the data is copied as stored from this entry of an open
+	// archive (without recompression) instead of being read from `path`
+	struct archive_data *data;
+	// if both `path` and `data` are NULL, the entry is stored empty (e.g. as a
+	// placeholder to reach the minimum number of entries)
+};
+
+/*
+ * Create an archive at `path` containing the given files (at least two).
+ * Files of the types that are stored compressed are LZSS-compressed at the
+ * given level (see `ai5_lzss_compress`) on `nr_threads` threads (or one
+ * thread per CPU if `nr_threads` is zero). The name length is chosen to fit
+ * the longest name.
+ *
+ * The archive is written to "`path`.tmp" and renamed to `path` once complete;
+ * on failure the temporary file is removed and `path` is left untouched.
+ */
+bool archive_create(const char *path, const struct archive_create_entry *entries,
+		unsigned n, unsigned nr_threads, int level)
+	attr_nonnull;
+
 /*
  * Iterate over the list of files in an archive. The caller does NOT own a
  * reference to the entries it iterates over, and data is NOT loaded.
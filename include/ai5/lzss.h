@@ -0,0 +1,98 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef AI5_LZSS_H
+#define AI5_LZSS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum ai5_lzss_status {
+	AI5_LZSS_OK,
+	AI5_LZSS_OVERRUN,  // the data decompresses to more than fits in the buffer
+	AI5_LZSS_UNDERRUN, // the data decompresses to less than the buffer size
+	AI5_LZSS_TRUNCATED, // the data ends in the middle of a reference
+};
+
+/*
+ * Decompress LZSS data into a buffer of `out_size` bytes, for data whose
+ * decompressed size is known in advance. On overrun the buffer holds the first
+ * `out_size` bytes of the data. If `out_len` is not NULL, the number of bytes
+ * written is stored there; the contents of the rest of the buffer are
+ * unspecified.
+ */
+enum ai5_lzss_status ai5_lzss_decompress_into(const uint8_t *in, size_t in_size,
+		uint8_t *out, size_t out_size, size_t *out_len);
+
+/*
+ * Decompress LZSS data into a newly allocated buffer. The output is identical
+ * to that of nulib's `lzss_decompress`: a reference cut short at the end of
+ * the input is ignored (use `ai5_lzss_decompress_into` or the decoder to detect
+ * truncated data).
+ */
+uint8_t *ai5_lzss_decompress(const uint8_t *in, size_t in_size, size_t *out_size);
+
+/*
+ * Incremental decompressor, for decoding data a piece at a time into a buffer
+ * that holds only the most recent output.
+ */
+struct ai5_lzss_decoder {
+	const uint8_t *in;
+	size_t in_size;
+	size_t in_pos;
+	size_t out_pos; // number of bytes decoded so far
+	bool end;       // the input is exhausted
+	bool truncated; // the input ended in the middle of a reference
+};
+
+// bytes that `ai5_lzss_decode` may write beyond the requested amount
+#define AI5_LZSS_DECODE_SLACK (8 * 18 + 32)
+
+void ai5_lzss_decoder_init(struct ai5_lzss_decoder *d, const uint8_t *in, size_t in_size);
+
+/*
+ * Decode at least `min` bytes (fewer only at the end of the input) into
+ * `buf + pos`, where the `pos` bytes before it hold the preceding output: at
+ * least the last 4096 bytes, or all of it. Up to `min + AI5_LZSS_DECODE_SLACK`
+ * bytes may be written. Returns the number of bytes decoded, which is 0 once
+ * the input is exhausted.
+ */
+size_t ai5_lzss_decode(struct ai5_lzss_decoder *d, uint8_t *buf, size_t pos, size_t min);
+
+#define AI5_LZSS_DEFAULT_LEVEL 6
+#define AI5_LZSS_MAX_LEVEL 9
+
+/*
+ * Compress data with LZSS. `level` trades speed for compression ratio: 1 and
+ * 2 take the first good match, 3 to 8 search progressively harder and defer a
+ * match when the next byte starts a longer one, and 9 picks the cheapest
+ * sequence of literals and matches over the whole input. A level of 0 selects
+ * AI5_LZSS_DEFAULT_LEVEL.
+ */
+uint8_t *ai5_lzss_compress(const uint8_t *in, size_t in_size, size_t *out_size, int level);
+
+/*
+ * Compress data with LZSS on `nr_threads` threads (one per CPU if 0). The
+ * input is compressed in chunks of a few hundred KiB, which can't have
+ * matches that span them, so the output is slightly larger than (and not
+ * identical to) that of `ai5_lzss_compress`. Small inputs are compressed on
+ * the calling thread.
+ */
+uint8_t *ai5_lzss_compress_mt(const uint8_t *in, size_t in_size, size_t *out_size,
+		int level, unsigned nr_threads);
+
+#endif // AI5_LZSS_H
@@ -0,0 +1,109 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef AI5_VFS_H
+#define AI5_VFS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nulib.h"
+#include "nulib/hashtable.h"
+#include "nulib/vector.h"
+
+struct archive;
+struct archive_data;
+
+struct vfs_entry {
+	uint32_t source;
+	uint32_t index;
+};
+
+declare_hashtable_string_type(vfsindex, struct vfs_entry);
+
+enum vfs_source_type {
+	VFS_SOURCE_ARCHIVE,
+	VFS_SOURCE_DIR,
+};
+
+struct vfs_source {
+	enum vfs_source_type type;
+	union {
+		struct archive *arc;
+		struct {
+			// uppercase names, and the paths of the files they refer to
+			vector_t(char*) names;
+			vector_t(char*) files;
+			// one entry per file, loaded while referenced
+			struct archive_data *entries;
+		} dir;
+	};
+};
+
+/*
+ * A set of archives and directories accessed through a single index. When
+ * the same name exists in more than one source, the source added last takes
+ * precedence.
+ */
+struct vfs {
+	hashtable_t(vfsindex) index;
+	vector_t(struct vfs_source) sources;
+};
+
+/*
+ * Free a VFS, closing all of its archives.
+ */
+void vfs_free(struct vfs *vfs)
+	attr_nonnull;
+
+/*
+ * Create an empty VFS.
+ */
+struct vfs *vfs_new(void)
+	attr_dealloc(vfs_free, 1);
+
+/*
+ * Open an archive and add its entries to the VFS.
+ */
+bool vfs_add_archive(struct vfs *vfs, const char *path, unsigned flags)
+	attr_nonnull;
+
+/*
+ * Add the files in a directory (not including subdirectories) to the VFS.
+ * Loose files are loaded as-is, without decompression.
+ */
+bool vfs_add_dir(struct vfs *vfs, const char *path)
+	attr_nonnull;
+
+/*
+ * Get an entry by name. The entry data is loaded and the caller owns a
+ * reference to the entry, which must be released with `archive_data_release`.
+ *
+ * Loose files from directories are returned as entries without an archive
+ * (`archive` is NULL); they are read whole and stored as-is (never
+ * decompressed). As with archive entries, each file has a single entry which
+ * is shared by all references and unloaded when the last one is released.
+ */
+struct archive_data *vfs_get(struct vfs *vfs, const char *name)
+	attr_nonnull;
+
+/*
+ * Check whether a name exists in the VFS.
+ */
+bool vfs_exists(struct vfs *vfs, const char *name)
+	attr_nonnull;
+
+#endif // AI5_VFS_H
@@ -0,0 +1,255 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nulib.h"
+#include "nulib/vector.h"
+#include "ai5/arc.h"
+#include "internal.h"
+
+// read through gaps between entries smaller than this
+#define COALESCE_GAP (64 * 1024)
+// maximum size of a single coalesced read
+#define COALESCE_MAX (16 * 1024 * 1024)
+// maximum total size of reads in flight at once
+#define BATCH_WAVE_MAX (64 * 1024 * 1024)
+
+struct batch_item {
+	struct archive_data *data;
+	unsigned slot;
+	bool claimed;
+};
+
+static int batch_item_cmp(const void *_a, const void *_b)
+{
+	const struct batch_item *a = _a, *b = _b;
+	if (a->data->offset != b->data->offset)
+		return a->data->offset < b->data->offset ? -1 : 1;
+	if (a->data != b->data)
+		return a->data < b->data ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Decode raw data for a claimed entry and publish it. `raw` points either into
+ * the archive's mapping (`in_map`) or into a temporary read buffer.
+ */
+static bool batch_publish(struct archive_data *data, uint8_t *raw, bool in_map)
+{
+	uint8_t *buf = raw;
+	size_t size = data->raw_size;
+	bool mapped = true;
+	bool ok = archive_data_decode(data, &buf, &size, &mapped);
+	if (ok && mapped && !in_map) {
+		// still points into the read buffer
+		buf = xmalloc(size);
+		memcpy(buf, raw, size);
+		mapped = false;
+	}
+	archive_data_publish(data, buf, size, mapped, ok);
+	return ok;
+}
+
+struct batch_run {
+	unsigned start; // claimed entries items[start..end) are read together
+	unsigned end;
+	uint32_t offset;
+	uint32_t size;
+};
+
+/*
+ * Publish the claimed entries in a run. `buf` holds the run's data (unless the
+ * archive is mapped).
+ */
+static bool batch_publish_run(struct archive *arc, struct batch_item *items,
+		struct batch_run *run, uint8_t *buf, bool read_ok, struct archive_data **out)
+{
+	bool r = read_ok;
+	for (unsigned i = run->start; i < run->end; i++) {
+		if (!items[i].claimed)
+			continue;
+		struct archive_data *data = items[i].data;
+		if (!read_ok) {
+			archive_data_publish(data, NULL, 0, false, false);
+			continue;
+		}
+		uint8_t *raw = arc->mapped ? arc->map.data + data->offset
+			: buf + (data->offset - run->offset);
+		if (batch_publish(data, raw, arc->mapped))
+			out[items[i].slot] = data;
+		else
+			r = false;
+	}
+	return r;
+}
+
+/*
+ * Read and publish the runs in runs[0..n). Reads are issued together, in waves
+ * of at most BATCH_WAVE_MAX bytes.
+ */
+static bool batch_read_runs(struct archive *arc, struct batch_item *items,
+		struct batch_run *runs, unsigned n, struct archive_data **out)
+{
+	bool r = true;
+	if (arc->mapped) {
+		for (unsigned i = 0; i < n; i++) {
+			if (!batch_publish_run(arc, items, &runs[i], NULL, true, out))
+				r = false;
+		}
+		return r;
+	}
+
+	struct archive_read *reads = xcalloc(n, sizeof(struct archive_read));
+	for (unsigned start = 0; start < n;) {
+		unsigned end = start;
+		size_t wave_size = 0;
+		do {
+			reads[end] = (struct archive_read) {
+				.offset = runs[end].offset,
+				.buf = xmalloc(runs[end].size),
+				.size = runs[end].size,
+			};
+			wave_size += runs[end].size;
+			end++;
+		} while (end < n && wave_size + runs[end].size <= BATCH_WAVE_MAX);
+
+		archive_read_many(arc, reads + start, end - start);
+		for (unsigned i = start; i < end; i++) {
+			if (!batch_publish_run(arc, items, &runs[i], reads[i].buf, reads[i].ok, out))
+				r = false;
+			free(reads[i].buf);
+		}
+		start = end;
+	}
+	free(reads);
+	return r;
+}
+
+static bool batch_load(struct archive *arc, struct batch_item *items, unsigned n,
+		struct archive_data **out)
+{
+	bool r = true;
+	qsort(items, n, sizeof(struct batch_item), batch_item_cmp);
+
+	// claim the entries that need to be loaded (duplicates are handled below)
+	for (unsigned i = 0; i < n; i++) {
+		if (i > 0 && items[i].data == items[i-1].data)
+			continue;
+		items[i].claimed = archive_data_claim(items[i].data);
+		if (!items[i].claimed)
+			out[items[i].slot] = items[i].data;
+	}
+
+	// group nearby entries into runs which are read with one read each
+	unsigned nr_runs = 0;
+	struct batch_run *runs = xcalloc(n ? n : 1, sizeof(struct batch_run));
+	for (unsigned i = 0; i < n;) {
+		if (!items[i].claimed) {
+			i++;
+			continue;
+		}
+		// computed in 64 bits so that entries near the end of a 4 GiB
+		// archive can't wrap around
+		uint64_t run_offset = items[i].data->offset;
+		uint64_t run_end = run_offset + items[i].data->raw_size;
+		unsigned j;
+		for (j = i + 1; j < n; j++) {
+			if (!items[j].claimed)
+				continue;
+			struct archive_data *data = items[j].data;
+			uint64_t data_end = (uint64_t)data->offset + data->raw_size;
+			if (data_end < run_end)
+				data_end = run_end;
+			if (data->offset > run_end + COALESCE_GAP)
+				break;
+			if (data_end - run_offset > COALESCE_MAX)
+				break;
+			run_end = data_end;
+		}
+		runs[nr_runs++] = (struct batch_run) {
+			.start = i,
+			.end = j,
+			.offset = run_offset,
+			.size = run_end - run_offset,
+		};
+		i = j;
+	}
+	if (!batch_read_runs(arc, items, runs, nr_runs, out))
+		r = false;
+	free(runs);
+
+	// take additional references for duplicate requests
+	for (unsigned i = 1; i < n; i++) {
+		if (items[i].data != items[i-1].data)
+			continue;
+		struct archive_data *data = out[items[i-1].slot];
+		if (data && archive_data_load(data))
+			out[items[i].slot] = data;
+		else
+			r = false;
+	}
+	return r;
+}
+
+bool archive_get_many(struct archive *arc, const char * const *names, unsigned n,
+		struct archive_data **out)
+{
+	unsigned nr_items = 0;
+	archive_key_t *keys = xmalloc(n * sizeof(archive_key_t));
+	struct batch_item *items = xcalloc(n, sizeof(struct batch_item));
+	bool r = archive_key_many(arc, names, n, keys);
+	for (unsigned i = 0; i < n; i++) {
+		out[i] = NULL;
+		if (keys[i] == ARCHIVE_KEY_NONE)
+			continue;
+		items[nr_items++] = (struct batch_item) {
+			.data = &vector_A(arc->files, keys[i] - 1),
+			.slot = i
+		};
+	}
+
+	if (!batch_load(arc, items, nr_items, out))
+		r = false;
+	free(items);
+	free(keys);
+	return r;
+}
+
+bool archive_get_many_by_index(struct archive *arc, const unsigned *indices, unsigned n,
+		struct archive_data **out)
+{
+	bool r = true;
+	unsigned nr_items = 0;
+	struct batch_item *items = xcalloc(n, sizeof(struct batch_item));
+	for (unsigned i = 0; i < n; i++) {
+		out[i] = NULL;
+		if (indices[i] >= vector_length(arc->files)) {
+			r = false;
+			continue;
+		}
+		items[nr_items++] = (struct batch_item) {
+			.data = &vector_A(arc->files, indices[i]),
+			.slot = i
+		};
+	}
+
+	if (!batch_load(arc, items, nr_items, out))
+		r = false;
+	free(items);
+	return r;
+}
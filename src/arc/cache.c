@@ -0,0 +1,146 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Cache of released entries.
+ *
+ * When the last reference to an entry is released, its (decompressed) data
+ * is kept resident and the entry is linked into an LRU list. A subsequent
+ * load of the entry takes it back off the list instead of reading and
+ * decompressing it again. When the cache exceeds its byte budget, the least
+ * recently released entries are freed.
+ *
+ * All functions here are called with the archive lock held.
+ */
+
+#include <stdlib.h>
+
+#include "nulib.h"
+#include "nulib/vector.h"
+#include "ai5/arc.h"
+#include "internal.h"
+
+#define LRU_NONE UINT32_MAX
+
+static uint32_t entry_index(struct archive *arc, struct archive_data *data)
+{
+	return data - &vector_A(arc->files, 0);
+}
+
+static void lru_unlink(struct archive *arc, uint32_t i)
+{
+	uint32_t prev = arc->cache.prev[i];
+	uint32_t next = arc->cache.next[i];
+	if (prev == LRU_NONE)
+		arc->cache.head = next;
+	else
+		arc->cache.next[prev] = next;
+	if (next == LRU_NONE)
+		arc->cache.tail = prev;
+	else
+		arc->cache.prev[next] = prev;
+}
+
+static void lru_push_head(struct archive *arc, uint32_t i)
+{
+	arc->cache.prev[i] = LRU_NONE;
+	arc->cache.next[i] = arc->cache.head;
+	if (arc->cache.head == LRU_NONE)
+		arc->cache.tail = i;
+	else
+		arc->cache.prev[arc->cache.head] = i;
+	arc->cache.head = i;
+}
+
+static void cache_evict(struct archive *arc, size_t max_bytes)
+{
+	while (arc->cache.bytes > max_bytes && arc->cache.tail != LRU_NONE) {
+		uint32_t i = arc->cache.tail;
+		struct archive_data *data = &vector_A(arc->files, i);
+		lru_unlink(arc, i);
+		arc->cache.bytes -= data->size;
+		arc->cache.evictions++;
+		archive_stats_resident(arc, -(int64_t)data->size);
+		free(data->data);
+		data->data = NULL;
+		data->size = 0;
+		data->cached = 0;
+	}
+}
+
+bool archive_cache_take(struct archive *arc, struct archive_data *data)
+{
+	if (!data->cached)
+		return false;
+	lru_unlink(arc, entry_index(arc, data));
+	arc->cache.bytes -= data->size;
+	arc->cache.hits++;
+	data->cached = 0;
+	return true;
+}
+
+bool archive_cache_put(struct archive *arc, struct archive_data *data)
+{
+	// mapped data is free to reload; allocated entries aren't in the file list
+	if (!arc->cache.max_bytes || data->mapped || data->allocated || !data->data)
+		return false;
+	if (data->size > arc->cache.max_bytes)
+		return false;
+
+	cache_evict(arc, arc->cache.max_bytes - data->size);
+	lru_push_head(arc, entry_index(arc, data));
+	arc->cache.bytes += data->size;
+	data->cached = 1;
+	return true;
+}
+
+void archive_cache_free(struct archive *arc)
+{
+	if (arc->cache.prev)
+		cache_evict(arc, 0);
+	free(arc->cache.prev);
+	free(arc->cache.next);
+	arc->cache.prev = NULL;
+	arc->cache.next = NULL;
+}
+
+void archive_set_cache_size(struct archive *arc, size_t max_bytes)
+{
+	archive_lock(arc);
+	if (!arc->cache.prev && max_bytes) {
+		arc->cache.prev = xmalloc(vector_length(arc->files) * sizeof(uint32_t));
+		arc->cache.next = xmalloc(vector_length(arc->files) * sizeof(uint32_t));
+		arc->cache.head = LRU_NONE;
+		arc->cache.tail = LRU_NONE;
+	}
+	arc->cache.max_bytes = max_bytes;
+	if (arc->cache.prev)
+		cache_evict(arc, max_bytes);
+	archive_unlock(arc);
+}
+
+void archive_get_cache_stats(struct archive *arc, struct archive_cache_stats *out)
+{
+	archive_lock(arc);
+	*out = (struct archive_cache_stats) {
+		.hits = arc->cache.hits,
+		.misses = arc->cache.misses,
+		.evictions = arc->cache.evictions,
+		.bytes = arc->cache.bytes,
+		.max_bytes = arc->cache.max_bytes,
+	};
+	archive_unlock(arc);
+}
@@ -0,0 +1,333 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Whole-archive extraction.
+ *
+ * The calling thread reads raw entry data in archive order, and jobs on a
+ * thread pool decompress, convert and write out the entries. Entries are
+ * decoded into private buffers, so the archive's entries (and their reference
+ * counts) are not touched.
+ *
+ * Entry names come from the archive and are not trusted: names that could
+ * refer to anything but a file directly inside the destination directory are
+ * rejected, and of several entries with the same name only the one returned
+ * by lookups is extracted (so that no two workers write the same file). The
+ * same goes for different names that lead to the same file: "X.G24" and
+ * "X.GP8" are both written as "X.png" when converting CGs, and names that
+ * differ only in case are the same file on case-insensitive filesystems.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "nulib.h"
+#include "nulib/file.h"
+#include "ai5/arc.h"
+#include "ai5/cg.h"
+#include "thread_pool.h"
+#include "internal.h"
+
+// maximum number of entries read ahead of the workers
+#define JOBS_PER_THREAD 4
+// maximum raw bytes read ahead of the workers
+#define READ_AHEAD_MAX (64 * 1024 * 1024)
+// how far ahead of the reader the OS is asked to read
+#define ADVISE_WINDOW (8 * 1024 * 1024)
+
+struct extract {
+	const char *dest_dir;
+	unsigned flags;
+	pthread_mutex_t lock;
+	// signalled when a job completes
+	pthread_cond_t done;
+	unsigned in_flight;
+	size_t in_flight_bytes;
+	unsigned failed;
+};
+
+struct extract_job {
+	struct extract *x;
+	struct archive_data *data;
+	uint8_t *raw;
+	bool mapped;
+};
+
+static bool write_file(const char *path, uint8_t *data, size_t size)
+{
+	FILE *out = file_open_utf8(path, "wb");
+	if (!out) {
+		WARNING("file_open_utf8(\"%s\"): %s", path, strerror(errno));
+		return false;
+	}
+	bool r = true;
+	if (size && fwrite(data, size, 1, out) != 1) {
+		WARNING("fwrite(\"%s\"): %s", path, strerror(errno));
+		r = false;
+	}
+	if (fclose(out)) {
+		WARNING("fclose(\"%s\"): %s", path, strerror(errno));
+		r = false;
+	}
+	return r;
+}
+
+static bool write_png(const char *path, struct cg *cg)
+{
+	FILE *out = file_open_utf8(path, "wb");
+	if (!out) {
+		WARNING("file_open_utf8(\"%s\"): %s", path, strerror(errno));
+		return false;
+	}
+	bool r = cg_write(cg, out, CG_TYPE_PNG);
+	if (fclose(out)) {
+		WARNING("fclose(\"%s\"): %s", path, strerror(errno));
+		r = false;
+	}
+	return r;
+}
+
+/*
+ * Check that an entry name is a plain file name, so that the output path
+ * stays inside the destination directory.
+ */
+static bool name_is_safe(const char *name)
+{
+	if (!*name || !strcmp(name, ".") || !strcmp(name, ".."))
+		return false;
+	// no directory separators (of any platform) or drive letters
+	return !strpbrk(name, "/\\:");
+}
+
+static char *output_path(struct extract *x, struct archive_data *data, bool png)
+{
+	// "<dest_dir>/<name>", with the extension replaced by "png" if requested
+	// (CG types are determined by extension, so there always is one)
+	const char *name = data->name;
+	size_t name_len = png ? file_extension(name) - name : strlen(name);
+	size_t len = strlen(x->dest_dir) + 1 + name_len + 3 + 1;
+	char *path = xmalloc(len);
+	snprintf(path, len, "%s/%.*s%s", x->dest_dir, (int)name_len, name, png ? "png" : "");
+	return path;
+}
+
+static bool entry_converts(struct extract *x, struct archive_data *data)
+{
+	return (x->flags & ARCHIVE_EXTRACT_CONVERT_CG) && data->type == ARCHIVE_FILE_CG
+		&& data->cg_type != CG_TYPE_PNG;
+}
+
+static bool extract_entry(struct extract *x, struct archive_data *data, uint8_t *buf,
+		size_t size)
+{
+	if (entry_converts(x, data)) {
+		struct cg *cg = cg_load(buf, size, data->cg_type);
+		if (cg) {
+			char *path = output_path(x, data, true);
+			bool r = write_png(path, cg);
+			free(path);
+			cg_free(cg);
+			return r;
+		}
+		// write out the original data instead
+		WARNING("failed to decode CG: %s", data->name);
+	}
+
+	char *path = output_path(x, data, false);
+	bool r = write_file(path, buf, size);
+	free(path);
+	return r;
+}
+
+static void extract_job_run(void *_job)
+{
+	struct extract_job *job = _job;
+	struct extract *x = job->x;
+	uint8_t *buf = job->raw;
+	size_t size = job->data->raw_size;
+	bool mapped = job->mapped;
+	bool ok = archive_data_decode(job->data, &buf, &size, &mapped)
+		&& extract_entry(x, job->data, buf, size);
+	if (!mapped)
+		free(buf);
+
+	pthread_mutex_lock(&x->lock);
+	if (!ok)
+		x->failed++;
+	x->in_flight--;
+	x->in_flight_bytes -= job->mapped ? 0 : job->data->raw_size;
+	pthread_cond_signal(&x->done);
+	pthread_mutex_unlock(&x->lock);
+	free(job);
+}
+
+struct output {
+	char *path;
+	unsigned i;
+};
+
+static int output_cmp(const void *_a, const void *_b)
+{
+	const struct output *a = _a, *b = _b;
+	int r = strcasecmp(a->path, b->path);
+	if (r)
+		return r;
+	return a->i < b->i ? -1 : a->i > b->i;
+}
+
+/*
+ * Drop entries whose output file is the same (ignoring case) as that of an
+ * earlier entry. Returns the number of entries kept, in their original order.
+ */
+static unsigned drop_duplicate_outputs(struct extract *x, struct archive_data **entries,
+		unsigned n)
+{
+	struct output *out = xmalloc((n ? n : 1) * sizeof(struct output));
+	for (unsigned i = 0; i < n; i++) {
+		out[i].path = output_path(x, entries[i], entry_converts(x, entries[i]));
+		out[i].i = i;
+	}
+	qsort(out, n, sizeof(struct output), output_cmp);
+	for (unsigned i = 0; i < n;) {
+		// the earliest entry of a group sorts first and is kept
+		unsigned j;
+		for (j = i + 1; j < n && !strcasecmp(out[j].path, out[i].path); j++) {
+			WARNING("not extracting \"%s\": \"%s\" is written to the same file",
+					entries[out[j].i]->name, entries[out[i].i]->name);
+			entries[out[j].i] = NULL;
+		}
+		i = j;
+	}
+	unsigned kept = 0;
+	for (unsigned i = 0; i < n; i++) {
+		free(out[i].path);
+		if (entries[i])
+			entries[kept++] = entries[i];
+	}
+	free(out);
+	return kept;
+}
+
+static int entry_offset_cmp(const void *_a, const void *_b)
+{
+	struct archive_data *a = *(struct archive_data**)_a;
+	struct archive_data *b = *(struct archive_data**)_b;
+	if (a->offset != b->offset)
+		return a->offset < b->offset ? -1 : 1;
+	return 0;
+}
+
+bool archive_extract_all(struct archive *arc, const char *dest_dir, unsigned nr_threads,
+		archive_extract_filter filter, void *user, unsigned flags)
+{
+	// select entries and put them in archive order
+	unsigned n = 0;
+	struct archive_data **entries = xmalloc((vector_length(arc->files) + 1)
+			* sizeof(struct archive_data*));
+	struct archive_data *data;
+	unsigned failed = 0;
+	archive_foreach(data, arc) {
+		if (!archive_data_visible(data))
+			continue;
+		if (filter && !filter(data, user))
+			continue;
+		if (!name_is_safe(data->name)) {
+			WARNING("refusing to extract file with unsafe name: \"%s\"", data->name);
+			failed++;
+			continue;
+		}
+		entries[n++] = data;
+	}
+
+	struct extract x = {
+		.dest_dir = dest_dir,
+		.flags = flags,
+	};
+	unsigned kept = drop_duplicate_outputs(&x, entries, n);
+	x.failed = failed + (n - kept);
+	n = kept;
+	qsort(entries, n, sizeof(struct archive_data*), entry_offset_cmp);
+
+	pthread_mutex_init(&x.lock, NULL);
+	pthread_cond_init(&x.done, NULL);
+
+	// the archive's own access pattern hints are left alone, since other
+	// threads may be using it; read-ahead is requested for the entries that
+	// are about to be read instead
+	unsigned advised = 0;
+
+	struct thread_pool *pool = thread_pool_new(nr_threads);
+	unsigned max_jobs = (nr_threads ? nr_threads : thread_pool_nr_cpus()) * JOBS_PER_THREAD;
+	for (unsigned i = 0; i < n; i++) {
+		struct archive_data *data = entries[i];
+		size_t raw_bytes = arc->mapped ? 0 : data->raw_size;
+
+		// keep the OS reading ahead of us, merging adjacent entries
+		uint64_t window_end = (uint64_t)data->offset + ADVISE_WINDOW;
+		while (advised < n && entries[advised]->offset < window_end) {
+			uint64_t start = entries[advised]->offset;
+			uint64_t end = start + entries[advised]->raw_size;
+			for (advised++; advised < n && entries[advised]->offset <= end
+					&& entries[advised]->offset < window_end; advised++) {
+				uint64_t e = (uint64_t)entries[advised]->offset + entries[advised]->raw_size;
+				end = e > end ? e : end;
+			}
+			archive_advise_willneed(arc, start, end - start);
+		}
+
+		// wait for the workers to catch up
+		pthread_mutex_lock(&x.lock);
+		while (x.in_flight && (x.in_flight >= max_jobs
+					|| x.in_flight_bytes + raw_bytes > READ_AHEAD_MAX))
+			pthread_cond_wait(&x.done, &x.lock);
+		pthread_mutex_unlock(&x.lock);
+
+		struct extract_job *job = xmalloc(sizeof(struct extract_job));
+		*job = (struct extract_job) {
+			.x = &x,
+			.data = data,
+			.mapped = arc->mapped,
+		};
+		if (arc->mapped) {
+			job->raw = arc->map.data + data->offset;
+		} else {
+			job->raw = xmalloc(data->raw_size ? data->raw_size : 1);
+			if (!archive_read_at(arc, data->offset, job->raw, data->raw_size)) {
+				free(job->raw);
+				free(job);
+				pthread_mutex_lock(&x.lock);
+				x.failed++;
+				pthread_mutex_unlock(&x.lock);
+				continue;
+			}
+		}
+
+		pthread_mutex_lock(&x.lock);
+		x.in_flight++;
+		x.in_flight_bytes += raw_bytes;
+		pthread_mutex_unlock(&x.lock);
+		thread_pool_submit(pool, extract_job_run, job);
+	}
+	thread_pool_free(pool);
+
+	pthread_mutex_destroy(&x.lock);
+	pthread_cond_destroy(&x.done);
+	free(entries);
+	return x.failed == 0;
+}
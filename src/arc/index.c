@@ -0,0 +1,307 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Sidecar index files.
+ *
+ * A sidecar index stores the decoded file list of an archive (offsets, sizes
+ * and UTF-8 names) together with a ready-made hash table, so that reopening
+ * the archive doesn't require decoding the archive index, converting names
+ * and building the hash table again. The index is keyed by the size and
+ * modification time of the archive and is ignored when either changes.
+ *
+ * Entries also carry their file type, so that nothing but the header is
+ * inspected when the index is loaded; the contents are trusted once the header
+ * matches.
+ *
+ * The index is a cache local to the machine that wrote it, so all values are
+ * stored in native byte order and it is used in place via mmap.
+ *
+ * Layout:
+ *     struct sidecar_header
+ *     struct sidecar_entry[nr_files]
+ *     struct archive_index_bucket buckets[nr_buckets]
+ *     char names[names_size] (NUL-terminated UTF-8 names)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "nulib.h"
+#include "nulib/file.h"
+#include "nulib/vector.h"
+#include "ai5/arc.h"
+#include "internal.h"
+
+#define SIDECAR_MAGIC "AI5IDX\0\0"
+#define SIDECAR_VERSION 3
+#define SIDECAR_BYTE_ORDER 0x01020304
+
+struct sidecar_header {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t version;
+	uint64_t arc_size;
+	int64_t arc_mtime; // nanoseconds, where the OS provides them
+	uint32_t nr_files;
+	uint32_t name_length;
+	uint32_t offset_key;
+	uint32_t size_key;
+	uint32_t name_key;
+	uint32_t nr_buckets;
+	uint32_t names_size;
+	uint32_t reserved;
+};
+
+struct sidecar_entry {
+	uint32_t offset;
+	uint32_t raw_size;
+	uint32_t name;
+	uint8_t type;
+	uint8_t cg_type;
+	uint8_t compressed;
+	uint8_t reserved;
+};
+
+static bool archive_stat(FILE *fp, uint64_t *size, int64_t *mtime)
+{
+	struct stat s;
+	if (fstat(fileno(fp), &s)) {
+		WARNING("fstat: %s", strerror(errno));
+		return false;
+	}
+	*size = s.st_size;
+	// whole seconds would miss a same-size rewrite within a second
+#if defined(_WIN32)
+	*mtime = (int64_t)s.st_mtime * 1000000000;
+#elif defined(__APPLE__)
+	*mtime = (int64_t)s.st_mtimespec.tv_sec * 1000000000 + s.st_mtimespec.tv_nsec;
+#else
+	*mtime = (int64_t)s.st_mtim.tv_sec * 1000000000 + s.st_mtim.tv_nsec;
+#endif
+	return true;
+}
+
+static uint8_t *sidecar_map(const char *path, size_t *size_out)
+{
+	FILE *fp = file_open_utf8(path, "rb");
+	if (!fp)
+		return NULL;
+
+	uint8_t *data = NULL;
+	struct stat s;
+	if (fstat(fileno(fp), &s)) {
+		WARNING("fstat: %s", strerror(errno));
+		goto end;
+	}
+	if (s.st_size < sizeof(struct sidecar_header))
+		goto end;
+#ifdef _WIN32
+	data = xmalloc(s.st_size);
+	if (fread(data, s.st_size, 1, fp) != 1) {
+		WARNING("fread: %s", strerror(errno));
+		free(data);
+		data = NULL;
+		goto end;
+	}
+#else
+	data = mmap(0, s.st_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+	if (data == MAP_FAILED) {
+		WARNING("mmap: %s", strerror(errno));
+		data = NULL;
+		goto end;
+	}
+#endif
+	*size_out = s.st_size;
+end:
+	fclose(fp);
+	return data;
+}
+
+static void sidecar_unmap(uint8_t *data, size_t size)
+{
+#ifdef _WIN32
+	free(data);
+#else
+	if (munmap(data, size))
+		WARNING("munmap: %s", strerror(errno));
+#endif
+}
+
+bool archive_sidecar_load(struct archive *arc, FILE *fp, const char *path)
+{
+	uint64_t arc_size;
+	int64_t arc_mtime;
+	if (!archive_stat(fp, &arc_size, &arc_mtime))
+		return false;
+
+	size_t size;
+	uint8_t *data = sidecar_map(path, &size);
+	if (!data)
+		return false;
+
+	// validate header
+	struct sidecar_header *h = (struct sidecar_header*)data;
+	if (memcmp(h->magic, SIDECAR_MAGIC, 8) || h->byte_order != SIDECAR_BYTE_ORDER
+			|| h->version != SIDECAR_VERSION)
+		goto stale;
+	if (h->arc_size != arc_size || h->arc_mtime != arc_mtime)
+		goto stale;
+	if (!h->nr_buckets || h->nr_buckets & (h->nr_buckets - 1) || h->nr_buckets <= h->nr_files)
+		goto invalid;
+	uint64_t expected_size = sizeof(struct sidecar_header)
+		+ (uint64_t)h->nr_files * sizeof(struct sidecar_entry)
+		+ (uint64_t)h->nr_buckets * sizeof(struct archive_index_bucket)
+		+ h->names_size;
+	if (expected_size != size)
+		goto invalid;
+
+	struct sidecar_entry *entries = (struct sidecar_entry*)(h + 1);
+	struct archive_index_bucket *buckets = (struct archive_index_bucket*)(entries + h->nr_files);
+	char *names = (char*)(buckets + h->nr_buckets);
+	// an empty archive has no names
+	if (h->names_size == 0 ? h->nr_files != 0 : names[h->names_size - 1] != '\0')
+		goto invalid;
+
+	arc->meta = (struct arc_metadata) {
+		.arc_size = h->arc_size,
+		.nr_files = h->nr_files,
+		.name_length = h->name_length,
+		.offset_key = h->offset_key,
+		.size_key = h->size_key,
+		.name_key = h->name_key,
+	};
+
+	// the names and lookup table are used in place; the entries are copied
+	// without being validated or classified again
+	vector_init(arc->files);
+	vector_resize(struct archive_data, arc->files, h->nr_files);
+	for (uint32_t i = 0; i < h->nr_files; i++) {
+		struct sidecar_entry *e = &entries[i];
+		vector_A(arc->files, i) = (struct archive_data) {
+			.offset = e->offset,
+			.raw_size = e->raw_size,
+			.name = names + e->name,
+			.compressed = e->compressed,
+			.type = e->type,
+			.cg_type = e->cg_type,
+			.archive = arc
+		};
+	}
+
+	arc->sidecar.data = data;
+	arc->sidecar.size = size;
+	arc->index.buckets = buckets;
+	arc->index.nr_buckets = h->nr_buckets;
+	arc->names.data = names;
+	arc->names.size = h->names_size;
+	return true;
+invalid:
+	WARNING("ignoring invalid index file: %s", path);
+stale:
+	sidecar_unmap(data, size);
+	return false;
+}
+
+bool archive_sidecar_save(struct archive *arc, FILE *fp, const char *path)
+{
+	struct sidecar_header h = {
+		.byte_order = SIDECAR_BYTE_ORDER,
+		.version = SIDECAR_VERSION,
+		.nr_files = vector_length(arc->files),
+		.name_length = arc->meta.name_length,
+		.offset_key = arc->meta.offset_key,
+		.size_key = arc->meta.size_key,
+		.name_key = arc->meta.name_key,
+	};
+	memcpy(h.magic, SIDECAR_MAGIC, 8);
+	if (!archive_stat(fp, &h.arc_size, &h.arc_mtime))
+		return false;
+
+	// the lookup table and names are written as-is
+	h.nr_buckets = arc->index.nr_buckets;
+	h.names_size = arc->names.size;
+
+	struct sidecar_entry *entries = xcalloc(h.nr_files, sizeof(struct sidecar_entry));
+	for (uint32_t i = 0; i < h.nr_files; i++) {
+		struct archive_data *data = &vector_A(arc->files, i);
+		entries[i].offset = data->offset;
+		entries[i].raw_size = data->raw_size;
+		entries[i].name = data->name - arc->names.data;
+		entries[i].type = data->type;
+		entries[i].cg_type = data->cg_type;
+		entries[i].compressed = data->compressed;
+	}
+
+	// write to a temporary file and move it into place, so that a concurrent
+	// reader never sees a partially written index
+	bool r = false;
+	char *tmp_path = xmalloc(strlen(path) + 5);
+	strcpy(tmp_path, path);
+	strcat(tmp_path, ".tmp");
+	FILE *out = file_open_utf8(tmp_path, "wb");
+	if (!out) {
+		WARNING("file_open_utf8: %s", strerror(errno));
+		goto end;
+	}
+	if (fwrite(&h, sizeof(h), 1, out) != 1)
+		goto write_error;
+	if (h.nr_files && fwrite(entries, sizeof(struct sidecar_entry), h.nr_files, out) != h.nr_files)
+		goto write_error;
+	if (fwrite(arc->index.buckets, sizeof(struct archive_index_bucket), h.nr_buckets, out)
+			!= h.nr_buckets)
+		goto write_error;
+	if (h.names_size && fwrite(arc->names.data, h.names_size, 1, out) != 1)
+		goto write_error;
+	if (fclose(out)) {
+		out = NULL;
+		goto write_error;
+	}
+	out = NULL;
+#ifdef _WIN32
+	remove(path);
+#endif
+	if (rename(tmp_path, path)) {
+		WARNING("rename: %s", strerror(errno));
+		remove(tmp_path);
+		goto end;
+	}
+	r = true;
+	goto end;
+write_error:
+	WARNING("Write failure: %s", strerror(errno));
+	if (out)
+		fclose(out);
+	remove(tmp_path);
+end:
+	free(tmp_path);
+	free(entries);
+	return r;
+}
+
+void archive_sidecar_unmap(struct archive *arc)
+{
+	if (!arc->sidecar.data)
+		return;
+	sidecar_unmap(arc->sidecar.data, arc->sidecar.size);
+	arc->sidecar.data = NULL;
+}
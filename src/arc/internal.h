@@ -0,0 +1,155 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef AI5_ARC_INTERNAL_H
+#define AI5_ARC_INTERNAL_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "ai5/arc.h"
+
+/*
+ * Detect the name length and keys of an archive.
+ */
+bool archive_get_metadata(FILE *fp, struct arc_metadata *meta_out);
+
+/*
+ * Lock/unlock the archive (no-op unless ARCHIVE_THREADSAFE is set).
+ */
+void archive_lock(struct archive *arc);
+void archive_unlock(struct archive *arc);
+
+/*
+ * Ask the OS to start reading the given range of the archive. Unlike
+ * `archive_advise`, this doesn't change the archive's access pattern hints,
+ * so it is safe to use while other threads are using the archive.
+ */
+void archive_advise_willneed(struct archive *arc, uint64_t offset, uint64_t size);
+
+/*
+ * Read raw bytes from the archive file (not valid for mmapped archives).
+ */
+bool archive_read_at(struct archive *arc, off_t offset, uint8_t *buf, size_t size);
+
+struct archive_read {
+	off_t offset;
+	uint8_t *buf;
+	size_t size;
+	bool ok; // set on return
+};
+
+/*
+ * Perform several reads from the archive file (not valid for mmapped archives),
+ * with all of them in flight at once where supported. Returns false if any read
+ * failed.
+ */
+bool archive_read_many(struct archive *arc, struct archive_read *reads, unsigned n);
+
+/*
+ * Release the archive's io_uring, if it has one.
+ */
+void archive_uring_free(struct archive *arc);
+
+/*
+ * Check whether a file with the given name is stored LZSS-compressed.
+ */
+bool archive_name_compressed(const char *name);
+
+/*
+ * Set the `compressed`, `type` and `cg_type` fields of an entry from its name.
+ */
+void archive_data_classify(struct archive_data *data);
+
+/*
+ * Decompress raw entry data, if the entry is of a compressed type (and the
+ * archive was not opened with ARCHIVE_RAW). If `*mapped` is false, `*buf` is
+ * owned by the caller and is freed when it is replaced.
+ */
+bool archive_data_decode(struct archive_data *data, uint8_t **buf, size_t *size,
+		bool *mapped);
+
+/*
+ * Begin loading an entry. Returns true if the caller is responsible for loading
+ * the data and must then call `archive_data_publish`. Returns false if the data
+ * was already resident (in which case a reference has been taken).
+ */
+bool archive_data_claim(struct archive_data *data);
+
+/*
+ * Finish loading an entry claimed with `archive_data_claim`. If `ok` is true,
+ * the caller's reference to the entry is created.
+ */
+void archive_data_publish(struct archive_data *data, uint8_t *buf, size_t size,
+		bool mapped, bool ok);
+
+/*
+ * Check whether an entry is the one found by lookups of its name, i.e. it is
+ * not shadowed by an earlier entry with the same name.
+ */
+bool archive_data_visible(struct archive_data *data);
+
+/*
+ * Build the name lookup table for the file list of `arc`.
+ */
+void archive_index_build(struct archive *arc);
+
+/*
+ * Statistics helpers (see stats.c).
+ */
+uint64_t archive_time_ns(void);
+void archive_stats_add(uint64_t *counter, uint64_t n);
+void archive_stats_resident(struct archive *arc, int64_t delta);
+
+/*
+ * Get the archive's worker thread pool (created on first use).
+ */
+struct thread_pool *archive_thread_pool(struct archive *arc);
+
+/*
+ * Populate the file list of `arc` from the sidecar index at `path`. Fails if
+ * the index doesn't exist or is stale with respect to the archive `fp`.
+ */
+bool archive_sidecar_load(struct archive *arc, FILE *fp, const char *path);
+
+/*
+ * Write the file list of `arc` to a sidecar index at `path`.
+ */
+bool archive_sidecar_save(struct archive *arc, FILE *fp, const char *path);
+
+/*
+ * Release the sidecar index.
+ */
+void archive_sidecar_unmap(struct archive *arc);
+
+/*
+ * Take an entry out of the cache of released entries. Returns false if the
+ * entry's data is not cached.
+ */
+bool archive_cache_take(struct archive *arc, struct archive_data *data);
+
+/*
+ * Add an entry whose reference count dropped to zero to the cache of released
+ * entries. Returns false if the entry should be freed instead.
+ */
+bool archive_cache_put(struct archive *arc, struct archive_data *data);
+
+/*
+ * Free all cached entries.
+ */
+void archive_cache_free(struct archive *arc);
+
+#endif // AI5_ARC_INTERNAL_H
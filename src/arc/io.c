@@ -0,0 +1,388 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Batched reads from the archive file.
+ *
+ * On Linux, a batch of reads is submitted to an io_uring owned by the archive
+ * so that all of them are in flight at once. The ring is created on first use
+ * with the archive's file registered. Elsewhere, or if the kernel doesn't
+ * support io_uring, the reads are issued one by one with `archive_read_at`.
+ *
+ * The destination buffers are not registered with the ring: they are
+ * allocated per entry and handed over to the caller, so they would have to be
+ * registered (and their pages pinned) anew for every batch, which costs more
+ * than the per-request mapping it saves.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef HAVE_IO_URING
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "nulib.h"
+#include "ai5/arc.h"
+#include "internal.h"
+
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES 64
+
+struct archive_uring {
+	int fd;
+	pthread_mutex_t lock;
+	bool broken; // set if requests may have been lost; the ring is not used again
+	// submission queue
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	// completion queue
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	// mappings
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_free(struct archive_uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring);
+}
+
+static void *uring_map(int fd, size_t size, off_t offset)
+{
+	void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static struct archive_uring *uring_new(int file_fd)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (fd < 0)
+		return NULL;
+
+	struct archive_uring *ring = xcalloc(1, sizeof(struct archive_uring));
+	ring->fd = fd;
+	pthread_mutex_init(&ring->lock, NULL);
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	if (!(ring->sq_ring = uring_map(fd, ring->sq_ring_size, IORING_OFF_SQ_RING)))
+		goto error;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else if (!(ring->cq_ring = uring_map(fd, ring->cq_ring_size, IORING_OFF_CQ_RING)))
+		goto error;
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (!(ring->sqes = uring_map(fd, ring->sqes_size, IORING_OFF_SQES)))
+		goto error;
+
+	uint8_t *sq = ring->sq_ring;
+	ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+	uint8_t *cq = ring->cq_ring;
+	ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	// the archive file is referenced by every read; registering it saves
+	// the kernel a file table lookup per request
+	if (sys_io_uring_register(fd, IORING_REGISTER_FILES, &file_fd, 1) < 0)
+		goto error;
+	return ring;
+error:
+	uring_free(ring);
+	return NULL;
+}
+
+static bool uring_queue_read(struct archive_uring *ring, struct archive_read *r,
+		unsigned i, size_t done)
+{
+	unsigned tail = *ring->sq_tail;
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > *ring->sq_mask)
+		return false;
+
+	unsigned idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = 0; // index into the registered files
+	sqe->addr = (uintptr_t)(r->buf + done);
+	sqe->len = r->size - done;
+	sqe->off = r->offset + done;
+	sqe->user_data = i;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/*
+ * Wait for every request still owned by the kernel to complete, after
+ * `io_uring_enter` failed. The buffers of those reads must not be freed
+ * before their completions arrive, and leaving the completions in the CQ
+ * would hand stale `user_data` to the next batch.
+ */
+static void uring_drain(struct archive_uring *ring, unsigned in_flight)
+{
+	// requests that the kernel hasn't consumed yet can simply be dropped
+	unsigned sq_head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	in_flight -= *ring->sq_tail - sq_head;
+	__atomic_store_n(ring->sq_tail, sq_head, __ATOMIC_RELEASE);
+
+	// reads from a regular file always complete, so there is no need to
+	// cancel them; if waiting keeps failing, any other syscall gives the
+	// kernel a chance to post pending completions
+	while (in_flight > 0) {
+		unsigned head = *ring->cq_head;
+		unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		in_flight -= tail - head < in_flight ? tail - head : in_flight;
+		__atomic_store_n(ring->cq_head, tail, __ATOMIC_RELEASE);
+		if (in_flight > 0 && sys_io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0)
+			sched_yield();
+	}
+}
+
+enum uring_status {
+	URING_DONE,   // all reads were performed
+	URING_BUSY,   // the ring is in use by another thread; nothing was read
+	URING_BROKEN, // the ring is unusable; reads that didn't complete are failed
+};
+
+/*
+ * Perform the reads in `reads` using the ring. If `wait` is false and another
+ * thread is using the ring, returns URING_BUSY without reading anything. On
+ * URING_BROKEN the ring should not be used again.
+ */
+static enum uring_status uring_read_many(struct archive *arc, struct archive_uring *ring,
+		struct archive_read *reads, unsigned n, bool wait)
+{
+	if (wait)
+		pthread_mutex_lock(&ring->lock);
+	else if (pthread_mutex_trylock(&ring->lock))
+		return URING_BUSY;
+	if (ring->broken) {
+		// the ring failed in another thread since it was looked up
+		pthread_mutex_unlock(&ring->lock);
+		return URING_BROKEN;
+	}
+
+	// bytes completed for each read (requests are reissued after short reads)
+	size_t *done = xcalloc(n, sizeof(size_t));
+	unsigned next = 0;     // next read to submit
+	unsigned in_flight = 0;
+	unsigned to_submit = 0;
+
+	while (next < n || in_flight > 0) {
+		// limiting requests in flight to the ring size keeps the CQ from
+		// overflowing
+		while (next < n && in_flight < URING_ENTRIES) {
+			if (reads[next].size == 0) {
+				reads[next++].ok = true;
+				continue;
+			}
+			if (!uring_queue_read(ring, &reads[next], next, 0))
+				break;
+			next++;
+			in_flight++;
+			to_submit++;
+		}
+		if (!in_flight)
+			break;
+
+		uint64_t start = archive_time_ns();
+		int rv = sys_io_uring_enter(ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+		archive_stats_add(&arc->stats.read_ns, archive_time_ns() - start);
+		if (rv < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			WARNING("io_uring_enter: %s", strerror(errno));
+			goto broken;
+		}
+		to_submit -= rv < to_submit ? rv : to_submit;
+
+		unsigned head = *ring->cq_head;
+		unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			unsigned i = cqe->user_data;
+			struct archive_read *r = &reads[i];
+			in_flight--;
+			if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+				// retried below
+			} else if (cqe->res == -EINVAL) {
+				// IORING_OP_READ needs Linux 5.6
+				r->ok = archive_read_at(arc, r->offset + done[i], r->buf + done[i],
+						r->size - done[i]);
+				continue;
+			} else if (cqe->res < 0) {
+				WARNING("io_uring read: %s", strerror(-cqe->res));
+				r->ok = false;
+				continue;
+			} else if (cqe->res == 0) {
+				WARNING("io_uring read: unexpected end of file");
+				r->ok = false;
+				continue;
+			} else {
+				done[i] += cqe->res;
+				archive_stats_add(&arc->stats.bytes_read, cqe->res);
+			}
+			if (done[i] == r->size) {
+				r->ok = true;
+				continue;
+			}
+			// short read: queue the remainder, submitting what is already
+			// queued if the SQ is full
+			while (!uring_queue_read(ring, r, i, done[i])) {
+				rv = sys_io_uring_enter(ring->fd, to_submit, 0, 0);
+				if (rv < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+					WARNING("io_uring_enter: %s", strerror(errno));
+					__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+					goto broken;
+				}
+				to_submit -= rv > 0 ? (rv < to_submit ? rv : to_submit) : 0;
+			}
+			in_flight++;
+			to_submit++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&ring->lock);
+	free(done);
+	return URING_DONE;
+broken:
+	// reads that haven't completed are left marked as failed, but we can
+	// only return once the kernel is done with their buffers
+	uring_drain(ring, in_flight);
+	ring->broken = true;
+	pthread_mutex_unlock(&ring->lock);
+	free(done);
+	return URING_BROKEN;
+}
+
+static struct archive_uring *archive_uring(struct archive *arc)
+{
+	archive_lock(arc);
+	if (!arc->uring && !arc->uring_unavailable) {
+		arc->uring = uring_new(fileno(arc->fp));
+		arc->uring_unavailable = !arc->uring;
+	}
+	struct archive_uring *ring = arc->uring_unavailable ? NULL : arc->uring;
+	archive_unlock(arc);
+	return ring;
+}
+
+void archive_uring_free(struct archive *arc)
+{
+	if (arc->uring)
+		uring_free(arc->uring);
+	arc->uring = NULL;
+}
+
+#else // HAVE_IO_URING
+
+void archive_uring_free(struct archive *arc)
+{
+}
+
+#endif // HAVE_IO_URING
+
+bool archive_read_many(struct archive *arc, struct archive_read *reads, unsigned n)
+{
+	for (unsigned i = 0; i < n; i++) {
+		reads[i].ok = false;
+	}
+#ifdef HAVE_IO_URING
+	struct archive_uring *ring = archive_uring(arc);
+	if (ring) {
+		// a single read (e.g. from `archive_data_load`) doesn't wait for
+		// another thread's batch; it is read directly instead
+		enum uring_status status = uring_read_many(arc, ring, reads, n, n > 1);
+		if (status == URING_DONE)
+			goto end;
+		if (status == URING_BROKEN) {
+			// don't use the ring again (it is freed with the archive)
+			archive_lock(arc);
+			arc->uring_unavailable = true;
+			archive_unlock(arc);
+		}
+	}
+#endif
+	// read whatever the ring didn't
+	for (unsigned i = 0; i < n; i++) {
+		if (!reads[i].ok)
+			reads[i].ok = archive_read_at(arc, reads[i].offset, reads[i].buf,
+					reads[i].size);
+	}
+#ifdef HAVE_IO_URING
+end:
+#endif
+
+	for (unsigned i = 0; i < n; i++) {
+		if (!reads[i].ok)
+			return false;
+	}
+	return true;
+}
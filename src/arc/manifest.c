@@ -0,0 +1,503 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Content-hash manifests.
+ *
+ * A manifest records a hash of every entry in an archive. Comparing the
+ * manifests of two versions of an archive gives the entries that changed,
+ * which can then be written to a (much smaller) patch archive.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "nulib.h"
+#include "nulib/file.h"
+#include "nulib/little_endian.h"
+#include "ai5/arc.h"
+#include "thread_pool.h"
+#include "internal.h"
+
+// entries are hashed in chunks of at most this many raw bytes...
+#define CHUNK_BYTES (4 * 1024 * 1024)
+// ...or this many entries
+#define CHUNK_ENTRIES 256
+
+#define MANIFEST_MAGIC "#ai5-manifest 1"
+
+/*
+ * XXH64, see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+ */
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t le_get64(const uint8_t *b)
+{
+	return le_get32(b, 0) | ((uint64_t)le_get32(b, 4) << 32);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	return rotl64(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t v)
+{
+	acc ^= xxh64_round(0, v);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t xxh64(const uint8_t *p, size_t len, uint64_t seed)
+{
+	const uint8_t *end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = seed + XXH_PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_PRIME64_1;
+		do {
+			v1 = xxh64_round(v1, le_get64(p));
+			v2 = xxh64_round(v2, le_get64(p + 8));
+			v3 = xxh64_round(v3, le_get64(p + 16));
+			v4 = xxh64_round(v4, le_get64(p + 24));
+			p += 32;
+		} while (end - p >= 32);
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	} else {
+		h = seed + XXH_PRIME64_5;
+	}
+	h += len;
+
+	for (; end - p >= 8; p += 8) {
+		h ^= xxh64_round(0, le_get64(p));
+		h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (end - p >= 4) {
+		h ^= (uint64_t)le_get32(p, 0) * XXH_PRIME64_1;
+		h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH_PRIME64_5;
+		h = rotl64(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+struct hash_job {
+	struct archive_data **entries;
+	struct archive_manifest_entry *out;
+	unsigned n;
+	unsigned flags;
+	bool ok;
+};
+
+static bool hash_entry(struct archive_data *data, unsigned flags, uint8_t **tmp,
+		size_t *tmp_size, struct archive_manifest_entry *out)
+{
+	struct archive *arc = data->archive;
+	uint8_t *buf;
+	if (arc->mapped) {
+		buf = arc->map.data + data->offset;
+	} else {
+		// read into a buffer reused for the whole job
+		if (*tmp_size < data->raw_size) {
+			free(*tmp);
+			*tmp_size = data->raw_size;
+			*tmp = xmalloc(*tmp_size);
+		}
+		buf = *tmp;
+		if (!archive_read_at(arc, data->offset, buf, data->raw_size))
+			return false;
+	}
+
+	size_t size = data->raw_size;
+	bool mapped = true; // i.e. `buf` is not ours to free
+	if ((flags & ARCHIVE_MANIFEST_DECOMPRESSED)
+			&& !archive_data_decode(data, &buf, &size, &mapped))
+		return false;
+
+	out->hash = xxh64(buf, size, 0);
+	out->size = size;
+	if (!mapped)
+		free(buf);
+	return true;
+}
+
+static void hash_job_run(void *_job)
+{
+	struct hash_job *job = _job;
+	uint8_t *tmp = NULL;
+	size_t tmp_size = 0;
+	job->ok = true;
+
+	// the entries of a job are consecutive in the archive; ask for the
+	// whole range up front (without touching the archive's own hints,
+	// which other threads may rely on)
+	uint64_t start = job->entries[0]->offset, end = start;
+	for (unsigned i = 0; i < job->n; i++) {
+		uint64_t e = (uint64_t)job->entries[i]->offset + job->entries[i]->raw_size;
+		end = e > end ? e : end;
+	}
+	archive_advise_willneed(job->entries[0]->archive, start, end - start);
+	for (unsigned i = 0; i < job->n; i++) {
+		if (!hash_entry(job->entries[i], job->flags, &tmp, &tmp_size, &job->out[i])) {
+			WARNING("failed to hash archive entry: %s", job->entries[i]->name);
+			job->ok = false;
+		}
+	}
+	free(tmp);
+}
+
+static int entry_offset_cmp(const void *_a, const void *_b)
+{
+	struct archive_data *a = *(struct archive_data**)_a;
+	struct archive_data *b = *(struct archive_data**)_b;
+	if (a->offset != b->offset)
+		return a->offset < b->offset ? -1 : 1;
+	return 0;
+}
+
+static int manifest_entry_cmp(const void *_a, const void *_b)
+{
+	const struct archive_manifest_entry *a = _a, *b = _b;
+	return strcmp(a->name, b->name);
+}
+
+// a manifest entry together with the archive entry it was computed from
+struct manifest_sort {
+	struct archive_manifest_entry e;
+	struct archive_data *data;
+};
+
+static int manifest_sort_cmp(const void *_a, const void *_b)
+{
+	const struct manifest_sort *a = _a, *b = _b;
+	return strcmp(a->e.name, b->e.name);
+}
+
+void archive_manifest_free(struct archive_manifest *m)
+{
+	for (unsigned i = 0; i < m->nr_entries; i++) {
+		free(m->entries[i].name);
+	}
+	free(m->entries);
+	free(m);
+}
+
+/*
+ * Compute the manifest of an archive. If `data_out` is not NULL, it is set to
+ * an array of the archive entries corresponding to the manifest entries.
+ */
+static struct archive_manifest *manifest_new(struct archive *arc, unsigned nr_threads,
+		unsigned flags, struct archive_data ***data_out)
+{
+	// the entries visible through lookups, in archive order
+	unsigned n = 0;
+	struct archive_data **entries = xmalloc((vector_length(arc->files) + 1)
+			* sizeof(struct archive_data*));
+	struct archive_data *data;
+	archive_foreach(data, arc) {
+		if (archive_data_visible(data))
+			entries[n++] = data;
+	}
+	qsort(entries, n, sizeof(struct archive_data*), entry_offset_cmp);
+
+	struct archive_manifest *m = xmalloc(sizeof(struct archive_manifest));
+	m->flags = flags;
+	m->nr_entries = n;
+	m->entries = xcalloc(n ? n : 1, sizeof(struct archive_manifest_entry));
+
+	// split the entries into chunks of consecutive entries
+	unsigned nr_jobs = 0;
+	struct hash_job *jobs = xcalloc(n ? n : 1, sizeof(struct hash_job));
+	for (unsigned i = 0; i < n;) {
+		size_t bytes = 0;
+		unsigned j = i;
+		do {
+			bytes += entries[j++]->raw_size;
+		} while (j < n && j - i < CHUNK_ENTRIES && bytes < CHUNK_BYTES);
+		jobs[nr_jobs++] = (struct hash_job) {
+			.entries = entries + i,
+			.out = m->entries + i,
+			.n = j - i,
+			.flags = flags,
+		};
+		i = j;
+	}
+
+	struct thread_pool *pool = thread_pool_new(nr_threads);
+	for (unsigned i = 0; i < nr_jobs; i++) {
+		thread_pool_submit(pool, hash_job_run, &jobs[i]);
+	}
+	thread_pool_free(pool);
+
+	bool ok = true;
+	for (unsigned i = 0; i < nr_jobs; i++) {
+		if (!jobs[i].ok)
+			ok = false;
+	}
+	free(jobs);
+	if (!ok) {
+		free(entries);
+		archive_manifest_free(m);
+		return NULL;
+	}
+
+	// sort by name, keeping track of the archive entries
+	struct manifest_sort *sorted = xmalloc((n ? n : 1) * sizeof(struct manifest_sort));
+	for (unsigned i = 0; i < n; i++) {
+		sorted[i].e = m->entries[i];
+		sorted[i].e.name = xstrdup(entries[i]->name);
+		sorted[i].data = entries[i];
+	}
+	qsort(sorted, n, sizeof(struct manifest_sort), manifest_sort_cmp);
+	for (unsigned i = 0; i < n; i++) {
+		m->entries[i] = sorted[i].e;
+		entries[i] = sorted[i].data;
+	}
+	free(sorted);
+
+	if (data_out)
+		*data_out = entries;
+	else
+		free(entries);
+	return m;
+}
+
+struct archive_manifest *archive_manifest_new(struct archive *arc, unsigned nr_threads,
+		unsigned flags)
+{
+	return manifest_new(arc, nr_threads, flags, NULL);
+}
+
+struct archive_manifest *archive_manifest_load(const char *path)
+{
+	FILE *f = file_open_utf8(path, "rb");
+	if (!f) {
+		WARNING("file_open_utf8(\"%s\"): %s", path, strerror(errno));
+		return NULL;
+	}
+
+	char line[1024];
+	unsigned flags;
+	if (!fgets(line, sizeof(line), f)
+			|| sscanf(line, MANIFEST_MAGIC " %u", &flags) != 1) {
+		WARNING("not a manifest: %s", path);
+		fclose(f);
+		return NULL;
+	}
+
+	struct archive_manifest *m = xcalloc(1, sizeof(struct archive_manifest));
+	m->flags = flags;
+	unsigned cap = 0;
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!line[0])
+			continue;
+
+		uint64_t hash;
+		uint32_t size;
+		int name_pos;
+		if (sscanf(line, "%" SCNx64 " %" SCNu32 " %n", &hash, &size, &name_pos) != 2
+				|| !line[name_pos]) {
+			WARNING("invalid manifest line: %s", line);
+			archive_manifest_free(m);
+			fclose(f);
+			return NULL;
+		}
+		if (m->nr_entries == cap) {
+			cap = cap ? cap * 2 : 256;
+			m->entries = xrealloc(m->entries, cap * sizeof(struct archive_manifest_entry));
+		}
+		m->entries[m->nr_entries++] = (struct archive_manifest_entry) {
+			.name = xstrdup(line + name_pos),
+			.hash = hash,
+			.size = size,
+		};
+	}
+	fclose(f);
+	// don't rely on the file being sorted
+	qsort(m->entries, m->nr_entries, sizeof(struct archive_manifest_entry),
+			manifest_entry_cmp);
+	return m;
+}
+
+bool archive_manifest_save(struct archive_manifest *m, const char *path)
+{
+	FILE *f = file_open_utf8(path, "wb");
+	if (!f) {
+		WARNING("file_open_utf8(\"%s\"): %s", path, strerror(errno));
+		return false;
+	}
+	fprintf(f, MANIFEST_MAGIC " %u\n", m->flags);
+	for (unsigned i = 0; i < m->nr_entries; i++) {
+		struct archive_manifest_entry *e = &m->entries[i];
+		fprintf(f, "%016" PRIx64 " %" PRIu32 " %s\n", e->hash, e->size, e->name);
+	}
+	bool r = !ferror(f);
+	if (fclose(f))
+		r = false;
+	if (!r)
+		WARNING("failed to write manifest \"%s\": %s", path, strerror(errno));
+	return r;
+}
+
+bool archive_manifest_diff(struct archive_manifest *old, struct archive_manifest *new,
+		struct archive_change **changes, unsigned *nr_changes)
+{
+	if (old->flags != new->flags) {
+		WARNING("manifests were computed with different flags");
+		return false;
+	}
+
+	// both manifests are sorted by name
+	unsigned n = 0;
+	struct archive_change *c = xmalloc((old->nr_entries + new->nr_entries + 1)
+			* sizeof(struct archive_change));
+	unsigned i = 0, j = 0;
+	while (i < old->nr_entries || j < new->nr_entries) {
+		int cmp;
+		if (i == old->nr_entries)
+			cmp = 1;
+		else if (j == new->nr_entries)
+			cmp = -1;
+		else
+			cmp = strcmp(old->entries[i].name, new->entries[j].name);
+
+		if (cmp < 0) {
+			c[n++] = (struct archive_change) {
+				ARCHIVE_CHANGE_REMOVED, old->entries[i++].name
+			};
+		} else if (cmp > 0) {
+			c[n++] = (struct archive_change) {
+				ARCHIVE_CHANGE_ADDED, new->entries[j++].name
+			};
+		} else {
+			if (old->entries[i].hash != new->entries[j].hash
+					|| old->entries[i].size != new->entries[j].size) {
+				c[n++] = (struct archive_change) {
+					ARCHIVE_CHANGE_MODIFIED, new->entries[j].name
+				};
+			}
+			i++;
+			j++;
+		}
+	}
+	*changes = c;
+	*nr_changes = n;
+	return true;
+}
+
+/*
+ * Find an entry in a manifest by name. Returns the index of the entry, or -1.
+ */
+static int manifest_find(struct archive_manifest *m, const char *name)
+{
+	struct archive_manifest_entry key = { .name = (char*)name };
+	struct archive_manifest_entry *e = bsearch(&key, m->entries, m->nr_entries,
+			sizeof(struct archive_manifest_entry), manifest_entry_cmp);
+	return e ? e - m->entries : -1;
+}
+
+bool archive_create_patch(struct archive *arc, struct archive_manifest *base,
+		const char *path, unsigned nr_threads, unsigned *nr_changed)
+{
+	struct archive_data **data;
+	struct archive_manifest *m = manifest_new(arc, nr_threads, base->flags, &data);
+	if (!m)
+		return false;
+	struct archive_change *changes;
+	unsigned nr_changes;
+	if (!archive_manifest_diff(base, m, &changes, &nr_changes)) {
+		free(data);
+		archive_manifest_free(m);
+		return false;
+	}
+
+	// added and modified entries are named in `m`, which maps them to the
+	// archive entries they came from
+	unsigned n = 0;
+	struct archive_create_entry *entries = xcalloc(nr_changes + 2,
+			sizeof(struct archive_create_entry));
+	for (unsigned i = 0; i < nr_changes; i++) {
+		if (changes[i].type == ARCHIVE_CHANGE_REMOVED)
+			continue;
+		entries[n++] = (struct archive_create_entry) {
+			.name = changes[i].name,
+			.data = data[manifest_find(m, changes[i].name)],
+		};
+	}
+	if (nr_changed)
+		*nr_changed = n;
+
+	bool r = true;
+	char pad_name[32];
+	if (n == 1) {
+		// pad with an unchanged entry...
+		for (unsigned i = 0; i < m->nr_entries; i++) {
+			if (strcmp(m->entries[i].name, entries[0].name)) {
+				entries[n++] = (struct archive_create_entry) {
+					.name = m->entries[i].name,
+					.data = data[i],
+				};
+				break;
+			}
+		}
+	}
+	if (n == 1) {
+		// ...or if the archive has no other entries, with an empty entry
+		// whose name is used by neither version of the archive
+		for (unsigned i = 0; ; i++) {
+			snprintf(pad_name, sizeof(pad_name), i ? "PATCH%u.PAD" : "PATCH.PAD", i);
+			if (manifest_find(m, pad_name) < 0 && manifest_find(base, pad_name) < 0)
+				break;
+		}
+		entries[n++] = (struct archive_create_entry) { .name = pad_name };
+	}
+	if (n > 0)
+		r = archive_create(path, entries, n, nr_threads, 0);
+
+	free(entries);
+	free(changes);
+	free(data);
+	archive_manifest_free(m);
+	return r;
+}
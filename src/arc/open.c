@@ -31,68 +31,36 @@
 
 #include "nulib.h"
 #include "nulib/file.h"
-#include "nulib/hashtable.h"
 #include "nulib/little_endian.h"
-#include "nulib/lzss.h"
 #include "nulib/string.h"
 #include "nulib/utfsjis.h"
 #include "nulib/vector.h"
 #include "ai5/arc.h"
+#include "ai5/cg.h"
+#include "ai5/lzss.h"
+#include "thread_pool.h"
+#include "internal.h"
 
 #define MAX_SANE_FILES 100000
 
-define_hashtable_string(arcindex, int);
 
-static bool read_u32(FILE *fp, uint32_t *out)
-{
-	uint8_t buf[4];
-	if (fread(buf, 4, 1, fp) != 1) {
-		WARNING("fread: %s", strerror(errno));
-		return false;
-	}
-	*out = le_get32(buf, 0);
-	return true;
-}
-
-static bool read_u32_at(FILE *fp, off_t offset, uint32_t *out)
-{
-	if (fseek(fp, offset, SEEK_SET)) {
-		WARNING("fseek: %s", strerror(errno));
-		return false;
-	}
-	return read_u32(fp, out);
-}
-
-static bool read_u8_at(FILE *fp, off_t offset, uint8_t *out)
-{
-	if (fseek(fp, offset, SEEK_SET)) {
-		WARNING("fseek: %s", strerror(errno));
-		return false;
-	}
-	if (fread(out, 1, 1, fp) != 1) {
-		WARNING("fread: %s", strerror(errno));
-		return false;
-	}
-	return true;
-}
+// largest offset read when probing the archive metadata
+#define METADATA_PROBE_SIZE ((8 + 0x100) * 2 + 4)
 
-bool archive_get_metadata(FILE *fp, struct arc_metadata *meta_out)
+/*
+ * Detect the metadata from the first `hdr_size` bytes of an archive.
+ */
+static bool parse_metadata(const uint8_t *hdr, size_t hdr_size, off_t arc_size,
+		struct arc_metadata *meta_out)
 {
 	struct arc_metadata meta = {0};
+	meta.arc_size = arc_size;
 
-	// get size of archive
-	if (fseek(fp, 0, SEEK_END)) {
-		WARNING("fseek: %s", strerror(errno));
+	if (hdr_size < 4) {
+		WARNING("archive is truncated");
 		return false;
 	}
-	meta.arc_size = ftell(fp);
-	if (fseek(fp, 0, SEEK_SET)) {
-		WARNING("fseek: %s", strerror(errno));
-		return false;
-	}
-
-	if (!read_u32(fp, &meta.nr_files))
-		return false;
+	meta.nr_files = le_get32(hdr, 0);
 	if (meta.nr_files > MAX_SANE_FILES) {
 		WARNING("archive file count is not sane: %u", meta.nr_files);
 		return false;
@@ -100,15 +68,14 @@ bool archive_get_metadata(FILE *fp, struct arc_metadata *meta_out)
 
 	const unsigned name_lengths[] = { 0x14, 0x1e, 0x20, 0x100 };
 	for (int i = 0; i < ARRAY_SIZE(name_lengths); i++) {
-		uint32_t first_size, first_offset, second_offset;
-		if (!read_u8_at(fp, 3 + name_lengths[i], &meta.name_key))
-			return false;
-		if (!read_u32_at(fp, 4 + name_lengths[i], &first_size))
-			return false;
-		if (!read_u32_at(fp, 8 + name_lengths[i], &first_offset))
-			return false;
-		if (!read_u32_at(fp, (off_t)(8 + name_lengths[i]) * 2, &second_offset))
+		if ((8 + name_lengths[i]) * 2 + 4 > hdr_size) {
+			WARNING("archive is truncated");
 			return false;
+		}
+		meta.name_key = hdr[3 + name_lengths[i]];
+		uint32_t first_size = le_get32(hdr, 4 + name_lengths[i]);
+		uint32_t first_offset = le_get32(hdr, 8 + name_lengths[i]);
+		uint32_t second_offset = le_get32(hdr, (8 + name_lengths[i]) * 2);
 
 		uint32_t data_offset = (name_lengths[i] + 8) * meta.nr_files + 4;
 		meta.offset_key = data_offset ^ first_offset;
@@ -129,37 +96,81 @@ bool archive_get_metadata(FILE *fp, struct arc_metadata *meta_out)
 	return true;
 }
 
-static bool archive_read_index(FILE *fp, struct archive *arc)
+bool archive_get_metadata(FILE *fp, struct arc_metadata *meta_out)
 {
-	const struct arc_metadata *meta = &arc->meta;
-	if (fseek(fp, 4, SEEK_SET)) {
+	// get size of archive
+	if (fseek(fp, 0, SEEK_END)) {
+		WARNING("fseek: %s", strerror(errno));
+		return false;
+	}
+	off_t arc_size = ftell(fp);
+	if (fseek(fp, 0, SEEK_SET)) {
 		WARNING("fseek: %s", strerror(errno));
 		return false;
 	}
 
-	const size_t buf_len = (size_t)meta->nr_files * (meta->name_length + 8);
-	size_t buf_pos = 0;
-	uint8_t *buf = xmalloc(buf_len);
-	if (fread(buf, buf_len, 1, fp) != 1) {
+	// read everything the probe needs at once
+	uint8_t hdr[METADATA_PROBE_SIZE];
+	size_t hdr_size = fread(hdr, 1, sizeof(hdr), fp);
+	if (hdr_size < sizeof(hdr) && ferror(fp)) {
 		WARNING("fread: %s", strerror(errno));
 		return false;
 	}
+	return parse_metadata(hdr, hdr_size, arc_size, meta_out);
+}
 
-	// read file entries
-	vector_init(arc->files);
-	vector_resize(struct archive_data, arc->files, meta->nr_files);
-	for (int i = 0; i < meta->nr_files; i++) {
-		// decode file name
+static bool is_ascii(const char *s)
+{
+	for (; *s; s++) {
+		if (*s & 0x80)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Decode the file list from the raw index in `buf` (modified in place).
+ */
+static void parse_index(struct archive *arc, uint8_t *buf)
+{
+	const struct arc_metadata *meta = &arc->meta;
+	const size_t entry_size = meta->name_length + 8;
+
+	// decode file names and size the name arena; converting Shift-JIS to
+	// UTF-8 at most triples the length of a name
+	size_t names_size = 0;
+	for (size_t i = 0, pos = 0; i < meta->nr_files; i++, pos += entry_size) {
 		for (int j = 0; j < meta->name_length; j++) {
-			buf[buf_pos + j] ^= meta->name_key;
-			if (buf[buf_pos + j] == 0)
+			buf[pos + j] ^= meta->name_key;
+			if (buf[pos + j] == 0)
 				break;
 		}
-		buf[buf_pos + meta->name_length - 1] = 0;
+		buf[pos + meta->name_length - 1] = 0;
+		const char *sjis = (char*)buf + pos;
+		names_size += (is_ascii(sjis) ? 1 : 3) * strlen(sjis) + 1;
+	}
+
+	// read file entries; all names are stored in a single allocation
+	arc->names.data = xmalloc(names_size ? names_size : 1);
+	size_t names_pos = 0;
+	vector_init(arc->files);
+	vector_resize(struct archive_data, arc->files, meta->nr_files);
+	for (size_t i = 0, pos = 0; i < meta->nr_files; i++, pos += entry_size) {
+		uint32_t offset = le_get32(buf, pos + meta->name_length + 4) ^ meta->offset_key;
+		uint32_t raw_size = le_get32(buf, pos + meta->name_length) ^ meta->size_key;
+
+		// names are nearly always ASCII and can be used as-is
+		const char *sjis = (char*)buf + pos;
+		char *name = arc->names.data + names_pos;
+		if (is_ascii(sjis)) {
+			strcpy(name, sjis);
+		} else {
+			string utf8 = sjis_cstring_to_utf8(sjis, 0);
+			strcpy(name, utf8);
+			string_free(utf8);
+		}
+		names_pos += strlen(name) + 1;
 
-		uint32_t offset = le_get32(buf, buf_pos + meta->name_length + 4) ^ meta->offset_key;
-		uint32_t raw_size = le_get32(buf, buf_pos + meta->name_length) ^ meta->size_key;
-		string name = sjis_cstring_to_utf8((char*)buf + buf_pos, 0);
 		if (offset + raw_size > meta->arc_size) {
 			ERROR("%s @ %u + %u extends beyond EOF (%u)", name, offset, raw_size,
 					(unsigned)meta->arc_size);
@@ -174,47 +185,84 @@ static bool archive_read_index(FILE *fp, struct archive *arc)
 			.ref = 0,
 			.archive = arc
 		};
-		buf_pos += meta->name_length + 8;
+		archive_data_classify(&vector_A(arc->files, i));
 	}
-	free(buf);
+	arc->names.size = names_pos;
 
-	// create index
-	for (int i = 0; i < vector_length(arc->files); i++) {
-		int ret;
-		hashtable_iter_t k = hashtable_put(arcindex, &arc->index,
-				vector_A(arc->files, i).name,
-				&ret);
-		if (ret == HASHTABLE_KEY_PRESENT) {
-			WARNING("skipping duplicate file name in archive");
-			continue;
-		}
-		hashtable_val(&arc->index, k) = i;
+	archive_index_build(arc);
+}
+
+static size_t index_size(struct arc_metadata *meta)
+{
+	return (size_t)meta->nr_files * (meta->name_length + 8);
+}
+
+static bool archive_read_index(FILE *fp, struct archive *arc)
+{
+	if (fseek(fp, 4, SEEK_SET)) {
+		WARNING("fseek: %s", strerror(errno));
+		return false;
 	}
 
+	const size_t buf_len = index_size(&arc->meta);
+	uint8_t *buf = xmalloc(buf_len);
+	if (fread(buf, buf_len, 1, fp) != 1) {
+		WARNING("fread: %s", strerror(errno));
+		free(buf);
+		return false;
+	}
+
+	parse_index(arc, buf);
+	free(buf);
 	return true;
 }
 
-struct archive *archive_open(const char *path, unsigned flags)
+static struct archive *archive_alloc(void)
+{
+	struct archive *arc = xcalloc(1, sizeof(struct archive));
+	pthread_mutex_init(&arc->lock, NULL);
+	pthread_cond_init(&arc->loaded, NULL);
+	pthread_mutex_init(&arc->io_lock, NULL);
+	return arc;
+}
+
+static void archive_free(struct archive *arc)
+{
+	// the lookup table and names are in the sidecar index, if one is used
+	if (!arc->sidecar.data) {
+		free(arc->index.buckets);
+		free(arc->names.data);
+	}
+	vector_destroy(arc->files);
+	archive_sidecar_unmap(arc);
+	pthread_mutex_destroy(&arc->lock);
+	pthread_cond_destroy(&arc->loaded);
+	pthread_mutex_destroy(&arc->io_lock);
+	free(arc);
+}
+
+/*
+ * Open an archive from a FILE. The archive takes ownership of `fp`.
+ */
+static struct archive *archive_open_fp(FILE *fp, const char *index_path, unsigned flags)
 {
 #ifdef _WIN32
 	flags &= ~ARCHIVE_MMAP;
 #endif
-	FILE *fp = NULL;
-	struct archive *arc = xcalloc(1, sizeof(struct archive));
+	struct archive *arc = archive_alloc();
 
-	// open archive file
-	if (!(fp = file_open_utf8(path, "rb"))) {
-		WARNING("file_open_utf8: %s", strerror(errno));
-		goto error;
-	}
+	if (!index_path || !archive_sidecar_load(arc, fp, index_path)) {
+		if (!archive_get_metadata(fp, &arc->meta)) {
+			WARNING("failed to read archive metadata");
+			goto error;
+		}
 
-	if (!archive_get_metadata(fp, &arc->meta)) {
-		WARNING("failed to ared archive metadata");
-		goto error;
-	}
+		if (!archive_read_index(fp, arc)) {
+			goto error;
+		}
 
-	if (!archive_read_index(fp, arc)) {
-		goto error;
+		if (index_path)
+			archive_sidecar_save(arc, fp, index_path);
 	}
 
 	// store either mmap ptr/size or FILE* depending on flags
@@ -224,7 +272,12 @@ struct archive *archive_open(const char *path, unsigned flags)
 			WARNING("fileno: %s", strerror(errno));
 			goto error;
 		}
-		arc->map.data = mmap(0, arc->meta.arc_size, PROT_READ, MAP_SHARED, fd, 0);
+		int mmap_flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+		if (flags & ARCHIVE_POPULATE)
+			mmap_flags |= MAP_POPULATE;
+#endif
+		arc->map.data = mmap(0, arc->meta.arc_size, PROT_READ, mmap_flags, fd, 0);
 		arc->map.size = arc->meta.arc_size;
 		if (arc->map.data == MAP_FAILED) {
 			WARNING("mmap: %s", strerror(errno));
@@ -240,110 +293,548 @@ struct archive *archive_open(const char *path, unsigned flags)
 	}
 
 	arc->flags = flags;
+	archive_advise(arc, flags);
 	return arc;
 error:
-	vector_destroy(arc->files);
-	free(arc);
+	archive_free(arc);
 	if (fp && fclose(fp))
 		WARNING("fclose: %s", strerror(errno));
 	return NULL;
 }
 
-void archive_close(struct archive *arc)
+static struct archive *archive_open_path(const char *path, const char *index_path,
+		unsigned flags)
+{
+	FILE *fp = file_open_utf8(path, "rb");
+	if (!fp) {
+		WARNING("file_open_utf8: %s", strerror(errno));
+		return NULL;
+	}
+	return archive_open_fp(fp, index_path, flags);
+}
+
+struct archive *archive_open(const char *path, unsigned flags)
+{
+	return archive_open_path(path, NULL, flags);
+}
+
+struct archive *archive_open_indexed(const char *path, const char *index_path,
+		unsigned flags)
+{
+	return archive_open_path(path, index_path, flags);
+}
+
+struct archive *archive_open_fd(int fd, unsigned flags)
+{
+	FILE *fp = fdopen(fd, "rb");
+	if (!fp) {
+		WARNING("fdopen: %s", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	return archive_open_fp(fp, NULL, flags);
+}
+
+struct archive *archive_open_mem(const uint8_t *data, size_t size, unsigned flags)
 {
+	struct archive *arc = archive_alloc();
+	if (!parse_metadata(data, size < METADATA_PROBE_SIZE ? size : METADATA_PROBE_SIZE,
+				size, &arc->meta)) {
+		WARNING("failed to read archive metadata");
+		goto error;
+	}
+
+	const size_t buf_len = index_size(&arc->meta);
+	if (4 + buf_len > size) {
+		WARNING("archive index extends beyond end of data");
+		goto error;
+	}
+	uint8_t *buf = xmalloc(buf_len);
+	memcpy(buf, data + 4, buf_len);
+	parse_index(arc, buf);
+	free(buf);
+
+	// the caller's buffer is treated like a mapping which we don't own
+	arc->map.data = (uint8_t*)data;
+	arc->map.size = size;
+	arc->mapped = true;
+	arc->borrowed = true;
+	arc->flags = flags & ~ARCHIVE_MMAP;
+	return arc;
+error:
+	archive_free(arc);
+	return NULL;
+}
+
+void archive_advise(struct archive *arc, unsigned hints)
+{
+	const unsigned hint_flags = ARCHIVE_SEQUENTIAL | ARCHIVE_RANDOM | ARCHIVE_WILLNEED;
+	// loaders read `arc->flags` without the lock, so the hints are kept apart
+	archive_lock(arc);
+	arc->hints = hints & hint_flags;
+	archive_unlock(arc);
+	if (arc->borrowed)
+		return;
+#ifndef _WIN32
 	if (arc->mapped) {
+#ifdef MADV_SEQUENTIAL
+		int advice = MADV_NORMAL;
+		if (hints & ARCHIVE_SEQUENTIAL)
+			advice = MADV_SEQUENTIAL;
+		else if (hints & ARCHIVE_RANDOM)
+			advice = MADV_RANDOM;
+		if (madvise(arc->map.data, arc->map.size, advice))
+			WARNING("madvise: %s", strerror(errno));
+		if ((hints & ARCHIVE_WILLNEED) && madvise(arc->map.data, arc->map.size, MADV_WILLNEED))
+			WARNING("madvise: %s", strerror(errno));
+#endif
+	} else {
+#ifdef POSIX_FADV_SEQUENTIAL
+		int fd = fileno(arc->fp);
+		int advice = POSIX_FADV_NORMAL;
+		if (hints & ARCHIVE_SEQUENTIAL)
+			advice = POSIX_FADV_SEQUENTIAL;
+		else if (hints & ARCHIVE_RANDOM)
+			advice = POSIX_FADV_RANDOM;
+		// posix_fadvise returns the error rather than setting errno
+		int r = posix_fadvise(fd, 0, 0, advice);
+		if (r)
+			WARNING("posix_fadvise: %s", strerror(r));
+		if ((hints & ARCHIVE_WILLNEED) && (r = posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED)))
+			WARNING("posix_fadvise: %s", strerror(r));
+#endif
+	}
+#endif
+}
+
+void archive_advise_willneed(struct archive *arc, uint64_t offset, uint64_t size)
+{
+	if (arc->borrowed || !size)
+		return;
+#ifndef _WIN32
+	if (arc->mapped) {
+#ifdef MADV_WILLNEED
+		// madvise wants a page-aligned address
+		uintptr_t page = sysconf(_SC_PAGESIZE);
+		uintptr_t start = (uintptr_t)(arc->map.data + offset) & ~(page - 1);
+		uintptr_t end = (uintptr_t)(arc->map.data + offset + size);
+		if (madvise((void*)start, end - start, MADV_WILLNEED))
+			WARNING("madvise: %s", strerror(errno));
+#endif
+	} else {
+#ifdef POSIX_FADV_WILLNEED
+		int r = posix_fadvise(fileno(arc->fp), offset, size, POSIX_FADV_WILLNEED);
+		if (r)
+			WARNING("posix_fadvise: %s", strerror(r));
+#endif
+	}
+#endif
+}
+
+void archive_close(struct archive *arc)
+{
+	if (arc->pool)
+		thread_pool_free(arc->pool);
+	archive_uring_free(arc);
+	if (arc->borrowed) {
+		// memory is owned by the caller
+	} else if (arc->mapped) {
 		if (munmap(arc->map.data, arc->map.size))
 			WARNING("munmap: %s", strerror(errno));
 	} else {
 		if (fclose(arc->fp))
 			WARNING("fclose: %s", strerror(errno));
 	}
-	for (unsigned i = 0; i < vector_length(arc->files); i++) {
-		string_free(vector_A(arc->files, i).name);
+	archive_cache_free(arc);
+	archive_free(arc);
+}
+
+void archive_lock(struct archive *arc)
+{
+	if (arc && arc->flags & ARCHIVE_THREADSAFE)
+		pthread_mutex_lock(&arc->lock);
+}
+
+void archive_unlock(struct archive *arc)
+{
+	if (arc && arc->flags & ARCHIVE_THREADSAFE)
+		pthread_mutex_unlock(&arc->lock);
+}
+
+/*
+ * Read `size` bytes at `offset` without touching the shared file position, so
+ * that multiple threads may read from the archive at once.
+ */
+static bool read_at(struct archive *arc, off_t offset, uint8_t *buf, size_t size)
+{
+#ifdef _WIN32
+	// no pread on Windows: serialize access to the file position instead
+	// (even without ARCHIVE_THREADSAFE, since the library's own worker
+	// threads may read from any archive)
+	bool r = false;
+	pthread_mutex_lock(&arc->io_lock);
+	if (fseek(arc->fp, offset, SEEK_SET)) {
+		WARNING("fseek: %s", strerror(errno));
+	} else if (fread(buf, size, 1, arc->fp) != 1) {
+		WARNING("fread: %s", strerror(errno));
+	} else {
+		r = true;
 	}
-	vector_destroy(arc->files);
-	hashtable_destroy(arcindex, &arc->index);
-	free(arc);
+	pthread_mutex_unlock(&arc->io_lock);
+	return r;
+#else
+	int fd = fileno(arc->fp);
+	while (size > 0) {
+		ssize_t n = pread(fd, buf, size, offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			WARNING("pread: %s", strerror(errno));
+			return false;
+		}
+		if (n == 0) {
+			WARNING("pread: unexpected end of file");
+			return false;
+		}
+		buf += n;
+		offset += n;
+		size -= n;
+	}
+	return true;
+#endif
+}
+
+bool archive_read_at(struct archive *arc, off_t offset, uint8_t *buf, size_t size)
+{
+	uint64_t start = archive_time_ns();
+	bool r = read_at(arc, offset, buf, size);
+	archive_stats_add(&arc->stats.read_ns, archive_time_ns() - start);
+	if (r)
+		archive_stats_add(&arc->stats.bytes_read, size);
+	return r;
+}
+
+static const struct file_type {
+	const char *ext;
+	bool compressed;
+	enum archive_file_type type;
+	enum cg_type cg_type;
+} file_types[] = {
+	{ "mes", true,  ARCHIVE_FILE_MES },
+	{ "lib", true,  ARCHIVE_FILE_OTHER },
+	{ "a",   true,  ARCHIVE_FILE_OTHER },
+	{ "a4",  true,  ARCHIVE_FILE_OTHER },
+	{ "a6",  true,  ARCHIVE_FILE_A6 },
+	{ "msk", true,  ARCHIVE_FILE_OTHER },
+	{ "s4",  true,  ARCHIVE_FILE_ANIM },
+	{ "x",   true,  ARCHIVE_FILE_OTHER },
+	{ "dat", true,  ARCHIVE_FILE_OTHER },
+	{ "gp4", false, ARCHIVE_FILE_CG, CG_TYPE_GP4 },
+	{ "gp8", false, ARCHIVE_FILE_CG, CG_TYPE_GP8 },
+	{ "g16", false, ARCHIVE_FILE_CG, CG_TYPE_G16 },
+	{ "g24", false, ARCHIVE_FILE_CG, CG_TYPE_G24 },
+	{ "g32", false, ARCHIVE_FILE_CG, CG_TYPE_G32 },
+	{ "png", false, ARCHIVE_FILE_CG, CG_TYPE_PNG },
+};
+
+static const struct file_type *file_type_from_name(const char *name)
+{
+	const char *ext = file_extension(name);
+	for (unsigned i = 0; i < ARRAY_SIZE(file_types); i++) {
+		if (!strcasecmp(ext, file_types[i].ext))
+			return &file_types[i];
+	}
+	return NULL;
+}
+
+bool archive_name_compressed(const char *name)
+{
+	const struct file_type *t = file_type_from_name(name);
+	return t && t->compressed;
+}
+
+void archive_data_classify(struct archive_data *data)
+{
+	const struct file_type *t = file_type_from_name(data->name);
+	data->compressed = t && t->compressed;
+	data->type = t ? t->type : ARCHIVE_FILE_OTHER;
+	data->cg_type = t ? t->cg_type : 0;
 }
 
 /*
  * Decompress compressed file types.
  */
-static bool data_decompress(struct archive_data *data)
+static bool data_decompress(struct archive_data *data, uint8_t **buf, size_t *size,
+		bool *mapped)
 {
-	const char *ext = file_extension(data->name);
-	static const char *compressed_ext[] = { "mes", "lib", "a", "a4", "a6", "msk", "s4", "x", "dat" };
-	for (unsigned i = 0; i < ARRAY_SIZE(compressed_ext); i++) {
-		if (strcasecmp(ext, compressed_ext[i]))
-			continue;
-		size_t decompressed_size;
-		uint8_t *tmp = lzss_decompress(data->data, data->raw_size, &decompressed_size);
-		if (!data->mapped)
-			free(data->data);
-		data->mapped = false;
-		if (!tmp) {
-			WARNING("lzss_decompress failed");
-			data->data = NULL;
-			data->size = 0;
+	if (!data->compressed)
+		return true;
+
+	struct archive *arc = data->archive;
+	size_t decompressed_size;
+	uint64_t start = archive_time_ns();
+	uint8_t *tmp = ai5_lzss_decompress(*buf, *size, &decompressed_size);
+	archive_stats_add(&arc->stats.decompress_ns, archive_time_ns() - start);
+	if (!*mapped)
+		free(*buf);
+	*mapped = false;
+	if (!tmp) {
+		WARNING("lzss_decompress failed: %s", data->name);
+		*buf = NULL;
+		*size = 0;
+		return false;
+	}
+	archive_stats_add(&arc->stats.bytes_decompressed, decompressed_size);
+	*buf = tmp;
+	*size = decompressed_size;
+	return true;
+}
+
+bool archive_data_decode(struct archive_data *data, uint8_t **buf, size_t *size,
+		bool *mapped)
+{
+	// loose files (e.g. from `vfs_get`) are stored as-is
+	if (!data->archive || data->archive->flags & ARCHIVE_RAW)
+		return true;
+	return data_decompress(data, buf, size, mapped);
+}
+
+/*
+ * Read (and decompress) the data for an entry. The entry itself is not
+ * modified, so this may run without holding the archive lock.
+ */
+static bool data_read(struct archive_data *data, uint8_t **buf_out, size_t *size_out,
+		bool *mapped_out)
+{
+	struct archive *arc = data->archive;
+	uint8_t *buf;
+	size_t size = data->raw_size;
+	bool mapped = arc->mapped;
+
+	if (mapped) {
+		buf = arc->map.data + data->offset;
+	} else {
+		// through the archive's io_uring, where available
+		buf = xmalloc(data->raw_size);
+		struct archive_read r = {
+			.offset = data->offset,
+			.buf = buf,
+			.size = data->raw_size,
+		};
+		if (!archive_read_many(arc, &r, 1)) {
+			free(buf);
 			return false;
 		}
-		data->data = tmp;
-		data->size = decompressed_size;
-		break;
 	}
+
+	if (!archive_data_decode(data, &buf, &size, &mapped))
+		return false;
+
+	*buf_out = buf;
+	*size_out = size;
+	*mapped_out = mapped;
 	return true;
 }
 
-bool archive_data_load(struct archive_data *data)
+bool archive_data_claim(struct archive_data *data)
 {
+	struct archive *arc = data->archive;
+	archive_lock(arc);
+
+	// another thread is loading the data; wait for it to finish
+	while (data->loading)
+		pthread_cond_wait(&arc->loaded, &arc->lock);
+
 	// data already loaded by another caller
 	if (data->ref) {
 		data->ref++;
-		return true;
+		archive_unlock(arc);
+		return false;
+	}
+
+	// data still resident in the cache
+	if (archive_cache_take(arc, data)) {
+		data->ref = 1;
+		archive_unlock(arc);
+		return false;
 	}
 
 	assert(!data->data);
+	arc->cache.misses++;
+	data->loading = 1;
+	archive_unlock(arc);
+	return true;
+}
 
-	// load data
-	if (data->archive->mapped) {
-		data->data = data->archive->map.data + data->offset;
-		data->size = data->raw_size;
-		data->mapped = true;
-	} else {
-		if (fseek(data->archive->fp, data->offset, SEEK_SET)) {
-			WARNING("fseek: %s", strerror(errno));
+void archive_data_publish(struct archive_data *data, uint8_t *buf, size_t size,
+		bool mapped, bool ok)
+{
+	struct archive *arc = data->archive;
+	archive_lock(arc);
+	if (ok) {
+		data->data = buf;
+		data->size = size;
+		data->mapped = mapped;
+		data->ref = 1;
+		archive_stats_add(&arc->stats.loads, 1);
+		archive_stats_add(arc->mapped ? &arc->stats.mapped_loads : &arc->stats.file_loads, 1);
+		if (!mapped)
+			archive_stats_resident(arc, size);
+	}
+	data->loading = 0;
+	archive_unlock(arc);
+
+	if (arc->flags & ARCHIVE_THREADSAFE)
+		pthread_cond_broadcast(&arc->loaded);
+}
+
+bool archive_data_load(struct archive_data *data)
+{
+	// loose files (from `vfs_get`) can only be reloaded through the VFS
+	if (!data->archive) {
+		if (!data->ref)
 			return false;
+		data->ref++;
+		return true;
+	}
+
+	if (!archive_data_claim(data))
+		return true;
+
+	// load data
+	uint8_t *buf = NULL;
+	size_t size = 0;
+	bool mapped = false;
+	bool r = data_read(data, &buf, &size, &mapped);
+	archive_data_publish(data, buf, size, mapped, r);
+	return r;
+}
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+static uint32_t name_hash(const char *name)
+{
+	// FNV-1a
+	uint32_t h = FNV_OFFSET_BASIS;
+	for (const uint8_t *p = (const uint8_t*)name; *p; p++) {
+		h = (h ^ *p) * FNV_PRIME;
+	}
+	return h;
+}
+
+/*
+ * Convert a name to uppercase and hash it in a single pass. Returns the same
+ * hash as `name_hash(out)`.
+ */
+static uint32_t fold_name(const char *name, char out[256])
+{
+	uint32_t h = FNV_OFFSET_BASIS;
+	int i;
+	for (i = 0; name[i] && i < 255; i++) {
+		out[i] = toupper((uint8_t)name[i]);
+		h = (h ^ (uint8_t)out[i]) * FNV_PRIME;
+	}
+	out[i] = 0;
+	return h;
+}
+
+void archive_index_build(struct archive *arc)
+{
+	// load factor <= 0.5
+	uint32_t nr_files = vector_length(arc->files);
+	uint32_t nr_buckets = 1;
+	while (nr_buckets < nr_files * 2)
+		nr_buckets <<= 1;
+
+	uint32_t mask = nr_buckets - 1;
+	struct archive_index_bucket *buckets = xcalloc(nr_buckets,
+			sizeof(struct archive_index_bucket));
+	uint32_t *hashes = xmalloc(nr_files * sizeof(uint32_t));
+	for (uint32_t i = 0; i < nr_files; i++) {
+		hashes[i] = name_hash(vector_A(arc->files, i).name);
+	}
+
+	for (uint32_t i = 0; i < nr_files; i++) {
+		// the table is too large to stay in cache for big archives, so
+		// fetch the bucket for a later entry while inserting this one
+		if (i + 16 < nr_files)
+			__builtin_prefetch(&buckets[hashes[i + 16] & mask], 1);
+		const char *name = vector_A(arc->files, i).name;
+		uint32_t b = hashes[i] & mask;
+		for (; buckets[b].entry; b = (b + 1) & mask) {
+			if (!strcmp(arc->names.data + buckets[b].name, name))
+				break;
 		}
-		data->data = xmalloc(data->raw_size);
-		if (fread(data->data, data->raw_size, 1, data->archive->fp) != 1) {
-			WARNING("fread: %s", strerror(errno));
-			free(data->data);
-			return false;
+		if (buckets[b].entry) {
+			WARNING("skipping duplicate file name in archive");
+			continue;
 		}
-		data->size = data->raw_size;
+		buckets[b].entry = i + 1;
+		buckets[b].name = name - arc->names.data;
 	}
+	free(hashes);
+	arc->index.buckets = buckets;
+	arc->index.nr_buckets = nr_buckets;
+}
 
-	if (!(data->archive->flags & ARCHIVE_RAW) && !data_decompress(data))
-		return false;
+static int index_lookup(struct archive *arc, const char *name, uint32_t hash)
+{
+	// the table is never full, so there is always an empty bucket to stop at
+	uint32_t mask = arc->index.nr_buckets - 1;
+	for (uint32_t b = hash & mask; arc->index.buckets[b].entry; b = (b + 1) & mask) {
+		if (!strcmp(arc->names.data + arc->index.buckets[b].name, name))
+			return arc->index.buckets[b].entry - 1;
+	}
+	return -1;
+}
 
-	data->ref = 1;
-	return true;
+bool archive_data_visible(struct archive_data *data)
+{
+	// the table is built from the names as stored (not case folded), so
+	// this works for any stored name
+	struct archive *arc = data->archive;
+	return index_lookup(arc, data->name, name_hash(data->name))
+		== data - &vector_A(arc->files, 0);
 }
 
 int archive_get_index(struct archive *arc, const char *name)
 {
-	// convert name to uppercase
-	int i;
 	char upname[256];
-	for (i = 0; name[i] && i < 255; i++) {
-		upname[i] = toupper(name[i]);
-	}
-	upname[i] = 0;
+	uint32_t hash = fold_name(name, upname);
+	return index_lookup(arc, upname, hash);
+}
 
-	hashtable_iter_t k = hashtable_get(arcindex, &arc->index, upname);
-	if (k == hashtable_end(&arc->index))
-		return -1;
-	return hashtable_val(&arc->index, k);
+archive_key_t archive_key(struct archive *arc, const char *name)
+{
+	// keys are entry indices offset by one, so that 0 means "not found"
+	return archive_get_index(arc, name) + 1;
+}
+
+// number of names resolved together by `archive_key_many`
+#define KEY_BATCH 16
+
+bool archive_key_many(struct archive *arc, const char * const *names, unsigned n,
+		archive_key_t *out)
+{
+	bool r = true;
+	char upnames[KEY_BATCH][256];
+	uint32_t hashes[KEY_BATCH];
+	uint32_t mask = arc->index.nr_buckets - 1;
+	for (unsigned i = 0; i < n; i += KEY_BATCH) {
+		unsigned m = n - i < KEY_BATCH ? n - i : KEY_BATCH;
+		// hash the whole batch first so that the bucket fetches overlap
+		for (unsigned j = 0; j < m; j++) {
+			hashes[j] = fold_name(names[i + j], upnames[j]);
+			__builtin_prefetch(&arc->index.buckets[hashes[j] & mask]);
+		}
+		for (unsigned j = 0; j < m; j++) {
+			out[i + j] = index_lookup(arc, upnames[j], hashes[j]) + 1;
+			if (out[i + j] == ARCHIVE_KEY_NONE)
+				r = false;
+		}
+	}
+	return r;
 }
 
 struct archive_data *archive_get(struct archive *arc, const char *name)
@@ -360,6 +851,13 @@ struct archive_data *archive_get(struct archive *arc, const char *name)
 	return NULL;
 }
 
+struct archive_data *archive_get_by_key(struct archive *arc, archive_key_t key)
+{
+	if (key == ARCHIVE_KEY_NONE)
+		return NULL;
+	return archive_get_by_index(arc, key - 1);
+}
+
 struct archive_data *archive_get_by_index(struct archive *arc, unsigned i)
 {
 	if (i >= vector_length(arc->files))
@@ -373,14 +871,24 @@ struct archive_data *archive_get_by_index(struct archive *arc, unsigned i)
 
 void archive_data_release(struct archive_data *data)
 {
+	struct archive *arc = data->archive;
+	archive_lock(arc);
 	if (data->ref == 0)
 		ERROR("double-free of archive data");
-	if (--data->ref == 0) {
-		if (!data->mapped)
-			free(data->data);
-		data->data = NULL;
-		data->size = 0;
-		if (data->allocated)
-			free(data);
+	if (--data->ref > 0 || (arc && archive_cache_put(arc, data))) {
+		archive_unlock(arc);
+		return;
 	}
+
+	uint8_t *buf = data->mapped ? NULL : data->data;
+	bool allocated = data->allocated;
+	if (arc && buf)
+		archive_stats_resident(arc, -(int64_t)data->size);
+	data->data = NULL;
+	data->size = 0;
+	archive_unlock(arc);
+
+	free(buf);
+	if (allocated)
+		free(data);
 }
@@ -0,0 +1,153 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "nulib.h"
+#include "ai5/arc.h"
+#include "thread_pool.h"
+#include "internal.h"
+
+// entries loaded together by one job, in one batch of reads
+#define PREFETCH_BATCH 16
+
+struct prefetch_job {
+	struct archive_prefetch *prefetch;
+	unsigned start; // entries[start..start+n)
+	unsigned n;
+};
+
+struct archive_prefetch {
+	struct archive *arc;
+	pthread_mutex_t lock;
+	// signalled when the last job completes
+	pthread_cond_t done;
+	unsigned remaining;
+	unsigned failed;
+	unsigned nr_entries;
+	unsigned nr_jobs;
+	unsigned *indices;
+	struct archive_data **entries; // NULL for entries that failed to load
+	struct prefetch_job jobs[];
+};
+
+static void prefetch_run(void *_job)
+{
+	struct prefetch_job *job = _job;
+	struct archive_prefetch *p = job->prefetch;
+	// the reads of a batch are issued together (through the archive's
+	// io_uring, where available)
+	archive_get_many_by_index(p->arc, p->indices + job->start, job->n,
+			p->entries + job->start);
+
+	pthread_mutex_lock(&p->lock);
+	for (unsigned i = job->start; i < job->start + job->n; i++) {
+		if (!p->entries[i])
+			p->failed++;
+	}
+	if (--p->remaining == 0)
+		pthread_cond_broadcast(&p->done);
+	pthread_mutex_unlock(&p->lock);
+}
+
+struct thread_pool *archive_thread_pool(struct archive *arc)
+{
+	archive_lock(arc);
+	if (!arc->pool)
+		arc->pool = thread_pool_new(0);
+	archive_unlock(arc);
+	return arc->pool;
+}
+
+struct archive_prefetch *archive_prefetch(struct archive *arc, const char * const *names,
+		unsigned n)
+{
+	// the caller may access the archive while the prefetch is running, and
+	// locking can't be switched on safely once the archive is in use
+	if (!(arc->flags & ARCHIVE_THREADSAFE)) {
+		WARNING("archive_prefetch requires an archive opened with ARCHIVE_THREADSAFE");
+		return NULL;
+	}
+
+	unsigned max_jobs = (n + PREFETCH_BATCH - 1) / PREFETCH_BATCH;
+	struct archive_prefetch *p = xcalloc(1, sizeof(struct archive_prefetch)
+			+ max_jobs * sizeof(struct prefetch_job));
+	p->arc = arc;
+	p->indices = xmalloc((n ? n : 1) * sizeof(unsigned));
+	p->entries = xcalloc(n ? n : 1, sizeof(struct archive_data*));
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->done, NULL);
+
+	archive_key_t *keys = xmalloc((n ? n : 1) * sizeof(archive_key_t));
+	archive_key_many(arc, names, n, keys);
+	for (unsigned i = 0; i < n; i++) {
+		if (keys[i] == ARCHIVE_KEY_NONE) {
+			p->failed++;
+			continue;
+		}
+		p->indices[p->nr_entries++] = keys[i] - 1;
+	}
+	free(keys);
+
+	for (unsigned i = 0; i < p->nr_entries; i += PREFETCH_BATCH) {
+		unsigned left = p->nr_entries - i;
+		p->jobs[p->nr_jobs++] = (struct prefetch_job) {
+			.prefetch = p,
+			.start = i,
+			.n = left < PREFETCH_BATCH ? left : PREFETCH_BATCH,
+		};
+	}
+
+	p->remaining = p->nr_jobs;
+	struct thread_pool *pool = archive_thread_pool(arc);
+	for (unsigned i = 0; i < p->nr_jobs; i++) {
+		thread_pool_submit(pool, prefetch_run, &p->jobs[i]);
+	}
+	return p;
+}
+
+bool archive_prefetch_done(struct archive_prefetch *p)
+{
+	pthread_mutex_lock(&p->lock);
+	bool done = p->remaining == 0;
+	pthread_mutex_unlock(&p->lock);
+	return done;
+}
+
+bool archive_prefetch_wait(struct archive_prefetch *p)
+{
+	pthread_mutex_lock(&p->lock);
+	while (p->remaining)
+		pthread_cond_wait(&p->done, &p->lock);
+	bool ok = p->failed == 0;
+	pthread_mutex_unlock(&p->lock);
+	return ok;
+}
+
+void archive_prefetch_free(struct archive_prefetch *p)
+{
+	archive_prefetch_wait(p);
+	for (unsigned i = 0; i < p->nr_entries; i++) {
+		if (p->entries[i])
+			archive_data_release(p->entries[i]);
+	}
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->done);
+	free(p->indices);
+	free(p->entries);
+	free(p);
+}
@@ -0,0 +1,90 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * I/O and decompression statistics.
+ *
+ * Counters are updated with relaxed atomics from whichever thread does the
+ * work, so they are always on and don't depend on ARCHIVE_THREADSAFE.
+ */
+
+#include <time.h>
+
+#include "nulib.h"
+#include "ai5/arc.h"
+#include "internal.h"
+
+uint64_t archive_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void archive_stats_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+void archive_stats_resident(struct archive *arc, int64_t delta)
+{
+	uint64_t now = __atomic_add_fetch(&arc->stats.resident_bytes, delta, __ATOMIC_RELAXED);
+	uint64_t peak = __atomic_load_n(&arc->stats.peak_resident_bytes, __ATOMIC_RELAXED);
+	while (now > peak) {
+		if (__atomic_compare_exchange_n(&arc->stats.peak_resident_bytes, &peak, now,
+					true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+}
+
+#define load(field) __atomic_load_n(&arc->stats.field, __ATOMIC_RELAXED)
+
+void archive_get_stats(struct archive *arc, struct archive_stats *out)
+{
+	*out = (struct archive_stats) {
+		.loads = load(loads),
+		.mapped_loads = load(mapped_loads),
+		.file_loads = load(file_loads),
+		.bytes_read = load(bytes_read),
+		.bytes_decompressed = load(bytes_decompressed),
+		.read_ns = load(read_ns),
+		.decompress_ns = load(decompress_ns),
+		.resident_bytes = load(resident_bytes),
+		.peak_resident_bytes = load(peak_resident_bytes),
+	};
+}
+
+#undef load
+
+void archive_reset_stats(struct archive *arc)
+{
+	uint64_t *counters[] = {
+		&arc->stats.loads,
+		&arc->stats.mapped_loads,
+		&arc->stats.file_loads,
+		&arc->stats.bytes_read,
+		&arc->stats.bytes_decompressed,
+		&arc->stats.read_ns,
+		&arc->stats.decompress_ns,
+	};
+	for (unsigned i = 0; i < ARRAY_SIZE(counters); i++) {
+		__atomic_store_n(counters[i], 0, __ATOMIC_RELAXED);
+	}
+	// resident bytes is a level, not a counter; restart the peak from it
+	__atomic_store_n(&arc->stats.peak_resident_bytes,
+			__atomic_load_n(&arc->stats.resident_bytes, __ATOMIC_RELAXED),
+			__ATOMIC_RELAXED);
+}
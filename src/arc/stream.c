@@ -0,0 +1,190 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Streaming access to archive entries.
+ *
+ * Raw data is pulled from the archive (or the mapping) in small chunks and
+ * LZSS-compressed entries are decompressed incrementally, so memory use is
+ * bounded by the LZSS window plus the input buffer regardless of the size of
+ * the entry.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nulib.h"
+#include "ai5/arc.h"
+#include "internal.h"
+
+#define STREAM_BUF_SIZE 4096
+
+#define LZSS_N 4096
+#define LZSS_F 18
+#define LZSS_THRESHOLD 2
+
+struct archive_stream {
+	struct archive_data *data;
+	bool compressed;
+	bool error;
+	// input
+	uint32_t raw_pos; // position of `in` within the raw entry data
+	uint8_t *in;
+	size_t in_pos;
+	size_t in_len;
+	// LZSS state
+	unsigned flags;
+	unsigned r;
+	unsigned match_pos;
+	unsigned match_len;
+	uint8_t window[LZSS_N];
+	uint8_t buf[STREAM_BUF_SIZE];
+};
+
+/*
+ * Make more raw input available. Returns false at the end of the entry.
+ */
+static bool stream_fill(struct archive_stream *s)
+{
+	struct archive *arc = s->data->archive;
+	s->raw_pos += s->in_len;
+	s->in_pos = 0;
+	s->in_len = 0;
+
+	uint32_t remaining = s->data->raw_size - s->raw_pos;
+	if (remaining == 0 || s->error || !arc)
+		return false;
+
+	if (arc->mapped) {
+		// the mapping is the input buffer
+		s->in = arc->map.data + s->data->offset + s->raw_pos;
+		s->in_len = remaining;
+		return true;
+	}
+
+	size_t n = remaining < STREAM_BUF_SIZE ? remaining : STREAM_BUF_SIZE;
+	if (!archive_read_at(arc, (off_t)s->data->offset + s->raw_pos, s->buf, n)) {
+		s->error = true;
+		return false;
+	}
+	s->in = s->buf;
+	s->in_len = n;
+	return true;
+}
+
+static int stream_getc(struct archive_stream *s)
+{
+	if (s->in_pos >= s->in_len && !stream_fill(s))
+		return -1;
+	return s->in[s->in_pos++];
+}
+
+static size_t stream_read_raw(struct archive_stream *s, uint8_t *out, size_t n)
+{
+	size_t out_pos = 0;
+	while (out_pos < n) {
+		if (s->in_pos >= s->in_len && !stream_fill(s))
+			break;
+		size_t avail = s->in_len - s->in_pos;
+		size_t len = avail < n - out_pos ? avail : n - out_pos;
+		memcpy(out + out_pos, s->in + s->in_pos, len);
+		s->in_pos += len;
+		out_pos += len;
+	}
+	return out_pos;
+}
+
+static size_t stream_read_lzss(struct archive_stream *s, uint8_t *out, size_t n)
+{
+	size_t out_pos = 0;
+	while (out_pos < n) {
+		// continue copying a back-reference
+		if (s->match_len) {
+			uint8_t c = s->window[s->match_pos++ & (LZSS_N - 1)];
+			s->window[s->r++ & (LZSS_N - 1)] = c;
+			out[out_pos++] = c;
+			s->match_len--;
+			continue;
+		}
+
+		if (((s->flags >>= 1) & 0x100) == 0) {
+			int c = stream_getc(s);
+			if (c < 0)
+				break;
+			s->flags = c | 0xff00;
+		}
+
+		if (s->flags & 1) {
+			int c = stream_getc(s);
+			if (c < 0)
+				break;
+			s->window[s->r++ & (LZSS_N - 1)] = c;
+			out[out_pos++] = c;
+		} else {
+			int lo = stream_getc(s);
+			int hi = stream_getc(s);
+			if (lo < 0 || hi < 0)
+				break;
+			s->match_pos = lo | ((hi & 0xf0) << 4);
+			s->match_len = (hi & 0x0f) + LZSS_THRESHOLD + 1;
+		}
+	}
+	return out_pos;
+}
+
+struct archive_stream *archive_data_open_stream(struct archive_data *data)
+{
+	struct archive_stream *s = xmalloc(sizeof(struct archive_stream));
+	s->data = data;
+	s->compressed = data->archive && !(data->archive->flags & ARCHIVE_RAW)
+		&& data->compressed;
+	s->error = false;
+	s->raw_pos = 0;
+	s->in = s->buf;
+	s->in_pos = 0;
+	s->in_len = 0;
+	if (!data->archive) {
+		// loose file (e.g. from `vfs_get`): the loaded data is the input
+		s->in = data->data;
+		s->in_len = data->size;
+	}
+	s->flags = 0;
+	s->r = LZSS_N - LZSS_F;
+	s->match_pos = 0;
+	s->match_len = 0;
+	memset(s->window, 0, sizeof(s->window));
+	return s;
+}
+
+size_t archive_stream_read(struct archive_stream *s, void *out, size_t n)
+{
+	if (s->compressed) {
+		size_t r = stream_read_lzss(s, out, n);
+		archive_stats_add(&s->data->archive->stats.bytes_decompressed, r);
+		return r;
+	}
+	return stream_read_raw(s, out, n);
+}
+
+bool archive_stream_error(struct archive_stream *s)
+{
+	return s->error;
+}
+
+void archive_stream_close(struct archive_stream *s)
+{
+	free(s);
+}
@@ -0,0 +1,217 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "nulib.h"
+#include "nulib/file.h"
+#include "nulib/hashtable.h"
+#include "nulib/vector.h"
+#include "ai5/arc.h"
+#include "ai5/vfs.h"
+#include "internal.h"
+
+define_hashtable_string(vfsindex, struct vfs_entry);
+
+struct vfs *vfs_new(void)
+{
+	struct vfs *vfs = xcalloc(1, sizeof(struct vfs));
+	vector_init(vfs->sources);
+	return vfs;
+}
+
+void vfs_free(struct vfs *vfs)
+{
+	struct vfs_source *src;
+	vector_foreach_p(src, vfs->sources) {
+		switch (src->type) {
+		case VFS_SOURCE_ARCHIVE:
+			archive_close(src->arc);
+			break;
+		case VFS_SOURCE_DIR:
+			for (unsigned i = 0; i < vector_length(src->dir.names); i++) {
+				free(vector_A(src->dir.names, i));
+				free(vector_A(src->dir.files, i));
+				free(src->dir.entries[i].data);
+			}
+			free(src->dir.entries);
+			vector_destroy(src->dir.names);
+			vector_destroy(src->dir.files);
+			break;
+		}
+	}
+	vector_destroy(vfs->sources);
+	hashtable_destroy(vfsindex, &vfs->index);
+	free(vfs);
+}
+
+/*
+ * Add a name to the merged index. Later sources override earlier ones, but
+ * within a source the first entry with a given name wins (as with archive
+ * lookups).
+ */
+static void vfs_index_put(struct vfs *vfs, const char *name, uint32_t source, uint32_t index)
+{
+	int ret;
+	hashtable_iter_t k = hashtable_put(vfsindex, &vfs->index, name, &ret);
+	if (ret == HASHTABLE_KEY_PRESENT && hashtable_val(&vfs->index, k).source == source) {
+		WARNING("skipping duplicate file: %s", name);
+		return;
+	}
+	hashtable_val(&vfs->index, k) = (struct vfs_entry) {
+		.source = source,
+		.index = index
+	};
+}
+
+bool vfs_add_archive(struct vfs *vfs, const char *path, unsigned flags)
+{
+	struct archive *arc = archive_open(path, flags);
+	if (!arc)
+		return false;
+
+	uint32_t source = vector_length(vfs->sources);
+	vector_push(struct vfs_source, vfs->sources, ((struct vfs_source) {
+		.type = VFS_SOURCE_ARCHIVE,
+		.arc = arc
+	}));
+
+	for (unsigned i = 0; i < vector_length(arc->files); i++) {
+		// duplicates were already reported when the archive was indexed
+		struct archive_data *data = &vector_A(arc->files, i);
+		if (archive_data_visible(data))
+			vfs_index_put(vfs, data->name, source, i);
+	}
+	return true;
+}
+
+bool vfs_add_dir(struct vfs *vfs, const char *path)
+{
+	DIR *dir = opendir(path);
+	if (!dir) {
+		WARNING("opendir(\"%s\"): %s", path, strerror(errno));
+		return false;
+	}
+
+	struct vfs_source src = { .type = VFS_SOURCE_DIR };
+	vector_init(src.dir.names);
+	vector_init(src.dir.files);
+
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		size_t len = strlen(path) + strlen(ent->d_name) + 2;
+		char *file = xmalloc(len);
+		snprintf(file, len, "%s/%s", path, ent->d_name);
+
+		struct stat s;
+		if (stat(file, &s) || !S_ISREG(s.st_mode)) {
+			free(file);
+			continue;
+		}
+
+		char *name = xstrdup(ent->d_name);
+		for (char *p = name; *p; p++) {
+			*p = toupper((unsigned char)*p);
+		}
+		vector_push(char*, src.dir.names, name);
+		vector_push(char*, src.dir.files, file);
+	}
+	closedir(dir);
+
+	unsigned nr_files = vector_length(src.dir.names);
+	src.dir.entries = xcalloc(nr_files ? nr_files : 1, sizeof(struct archive_data));
+	for (unsigned i = 0; i < nr_files; i++) {
+		src.dir.entries[i].name = vector_A(src.dir.names, i);
+		archive_data_classify(&src.dir.entries[i]);
+	}
+
+	uint32_t source = vector_length(vfs->sources);
+	vector_push(struct vfs_source, vfs->sources, src);
+	for (unsigned i = 0; i < vector_length(src.dir.names); i++) {
+		vfs_index_put(vfs, vector_A(src.dir.names, i), source, i);
+	}
+	return true;
+}
+
+static bool vfs_lookup(struct vfs *vfs, const char *name, struct vfs_entry *out)
+{
+	// convert name to uppercase
+	int i;
+	char upname[256];
+	for (i = 0; name[i] && i < 255; i++) {
+		upname[i] = toupper((unsigned char)name[i]);
+	}
+	upname[i] = 0;
+
+	hashtable_iter_t k = hashtable_get(vfsindex, &vfs->index, upname);
+	if (k == hashtable_end(&vfs->index))
+		return false;
+	*out = hashtable_val(&vfs->index, k);
+	return true;
+}
+
+static struct archive_data *vfs_load_file(struct vfs_source *src, uint32_t i)
+{
+	// already loaded: take another reference
+	struct archive_data *data = &src->dir.entries[i];
+	if (data->ref) {
+		data->ref++;
+		return data;
+	}
+
+	size_t size;
+	const char *file = vector_A(src->dir.files, i);
+	uint8_t *buf = file_read(file, &size);
+	if (!buf) {
+		WARNING("file_read(\"%s\"): %s", file, strerror(errno));
+		return NULL;
+	}
+	data->raw_size = size;
+	data->size = size;
+	data->data = buf;
+	data->ref = 1;
+	return data;
+}
+
+struct archive_data *vfs_get(struct vfs *vfs, const char *name)
+{
+	struct vfs_entry e;
+	if (!vfs_lookup(vfs, name, &e))
+		return NULL;
+
+	struct vfs_source *src = &vector_A(vfs->sources, e.source);
+	switch (src->type) {
+	case VFS_SOURCE_ARCHIVE:
+		return archive_get_by_index(src->arc, e.index);
+	case VFS_SOURCE_DIR:
+		return vfs_load_file(src, e.index);
+	}
+	return NULL;
+}
+
+bool vfs_exists(struct vfs *vfs, const char *name)
+{
+	struct vfs_entry e;
+	return vfs_lookup(vfs, name, &e);
+}
@@ -0,0 +1,325 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "nulib.h"
+#include "nulib/file.h"
+#include "nulib/little_endian.h"
+#include "nulib/string.h"
+#include "nulib/utfsjis.h"
+#include "ai5/arc.h"
+#include "ai5/lzss.h"
+#include "thread_pool.h"
+#include "internal.h"
+
+// maximum number of files being read/compressed ahead of the writer
+#define JOBS_PER_THREAD 4
+
+struct create_job {
+	const struct archive_create_entry *entry;
+	string sjis_name;
+	bool compress;
+	int level;
+	// output
+	uint8_t *data;
+	size_t size;
+	bool ok;
+	bool done;
+	pthread_mutex_t *lock;
+	pthread_cond_t *cond;
+};
+
+/*
+ * Copy the data of an archive entry as it is stored in the archive.
+ */
+static uint8_t *read_stored(struct archive_data *entry, size_t *size_out)
+{
+	struct archive *arc = entry->archive;
+	uint8_t *data = xmalloc(entry->raw_size ? entry->raw_size : 1);
+	if (arc->mapped) {
+		memcpy(data, arc->map.data + entry->offset, entry->raw_size);
+	} else if (!archive_read_at(arc, entry->offset, data, entry->raw_size)) {
+		free(data);
+		return NULL;
+	}
+	*size_out = entry->raw_size;
+	return data;
+}
+
+static void create_job_run(void *_job)
+{
+	struct create_job *job = _job;
+	size_t size;
+	uint8_t *data;
+	if (!job->entry->data && !job->entry->path) {
+		// empty placeholder
+		data = xmalloc(1);
+		size = 0;
+	} else if (job->entry->data) {
+		// already in stored form
+		if (!(data = read_stored(job->entry->data, &size)))
+			WARNING("failed to read archive entry: %s", job->entry->data->name);
+	} else if (!(data = file_read(job->entry->path, &size))) {
+		WARNING("file_read(\"%s\"): %s", job->entry->path, strerror(errno));
+	} else if (job->compress) {
+		uint8_t *tmp = ai5_lzss_compress(data, size, &size, job->level);
+		free(data);
+		data = tmp;
+	}
+
+	pthread_mutex_lock(job->lock);
+	job->data = data;
+	job->size = size;
+	job->ok = !!data;
+	job->done = true;
+	pthread_cond_broadcast(job->cond);
+	pthread_mutex_unlock(job->lock);
+}
+
+/*
+ * Simple deterministic PRNG for picking keys, so that archives are
+ * reproducible.
+ */
+static uint32_t xorshift32(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+/*
+ * Pick a name key that doesn't collide with any byte used in a name (such
+ * bytes would decode to NUL).
+ */
+static bool pick_name_key(struct create_job *jobs, unsigned n, uint8_t *key_out)
+{
+	bool used[256] = { [0] = true };
+	for (unsigned i = 0; i < n; i++) {
+		for (const uint8_t *p = (uint8_t*)jobs[i].sjis_name; *p; p++) {
+			used[*p] = true;
+		}
+	}
+	// prefer keys with high bits set, like the original archives
+	for (int k = 255; k > 0; k--) {
+		if (!used[k]) {
+			*key_out = k;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool write_header(FILE *out, struct arc_metadata *meta, struct create_job *jobs,
+		uint32_t *offsets)
+{
+	size_t entry_size = meta->name_length + 8;
+	uint8_t *buf = xcalloc(1, 4 + meta->nr_files * entry_size);
+	le_put32(buf, 0, meta->nr_files);
+	for (unsigned i = 0; i < meta->nr_files; i++) {
+		uint8_t *e = buf + 4 + i * entry_size;
+		strcpy((char*)e, jobs[i].sjis_name);
+		for (unsigned j = 0; j < meta->name_length; j++) {
+			e[j] ^= meta->name_key;
+		}
+		le_put32(e, meta->name_length, jobs[i].size ^ meta->size_key);
+		le_put32(e, meta->name_length + 4, offsets[i] ^ meta->offset_key);
+	}
+
+	bool r = true;
+	if (fseek(out, 0, SEEK_SET)) {
+		WARNING("fseek: %s", strerror(errno));
+		r = false;
+	} else if (fwrite(buf, 4 + meta->nr_files * entry_size, 1, out) != 1) {
+		WARNING("fwrite: %s", strerror(errno));
+		r = false;
+	}
+	free(buf);
+	return r;
+}
+
+/*
+ * Check that `archive_get_metadata` recovers the parameters we used. The name
+ * length is detected heuristically, so some keys can lead to misdetection.
+ */
+static bool check_metadata(FILE *out, struct arc_metadata *meta)
+{
+	struct arc_metadata detected;
+	if (fflush(out)) {
+		WARNING("fflush: %s", strerror(errno));
+		return false;
+	}
+	return archive_get_metadata(out, &detected)
+		&& detected.name_length == meta->name_length
+		&& detected.offset_key == meta->offset_key
+		&& detected.size_key == meta->size_key
+		&& detected.name_key == meta->name_key;
+}
+
+bool archive_create(const char *path, const struct archive_create_entry *entries,
+		unsigned n, unsigned nr_threads, int level)
+{
+	static const unsigned name_lengths[] = { 0x14, 0x1e, 0x20, 0x100 };
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+	bool r = false;
+
+	// the keys can't be detected with fewer than two entries
+	if (n < 2) {
+		WARNING("an archive must contain at least two files");
+		return false;
+	}
+
+	struct create_job *jobs = xcalloc(n, sizeof(struct create_job));
+	uint32_t *offsets = xcalloc(n, sizeof(uint32_t));
+	struct arc_metadata meta = { .nr_files = n };
+	size_t max_name = 0;
+	for (unsigned i = 0; i < n; i++) {
+		// names are looked up in uppercase
+		char *upname = xstrdup(entries[i].name);
+		for (char *p = upname; *p; p++) {
+			*p = toupper((unsigned char)*p);
+		}
+		jobs[i] = (struct create_job) {
+			.entry = &entries[i],
+			.sjis_name = utf8_cstring_to_sjis(upname, 0),
+			.compress = archive_name_compressed(upname),
+			.level = level,
+			.lock = &lock,
+			.cond = &cond,
+		};
+		free(upname);
+		size_t len = strlen(jobs[i].sjis_name);
+		if (len > max_name)
+			max_name = len;
+	}
+
+	for (unsigned i = 0; i < ARRAY_SIZE(name_lengths); i++) {
+		if (max_name < name_lengths[i]) {
+			meta.name_length = name_lengths[i];
+			break;
+		}
+	}
+	if (!meta.name_length) {
+		WARNING("file name too long for archive");
+		goto end_names;
+	}
+	if (!pick_name_key(jobs, n, &meta.name_key)) {
+		WARNING("no usable name key");
+		goto end_names;
+	}
+
+	// write to a temporary file and move it into place on success, so that a
+	// failure never leaves a truncated archive at `path`
+	char *tmp_path = xmalloc(strlen(path) + 5);
+	strcpy(tmp_path, path);
+	strcat(tmp_path, ".tmp");
+	FILE *out = file_open_utf8(tmp_path, "w+b");
+	if (!out) {
+		WARNING("file_open_utf8(\"%s\"): %s", tmp_path, strerror(errno));
+		free(tmp_path);
+		goto end_names;
+	}
+
+	// reserve space for the header
+	uint64_t offset = 4 + (uint64_t)n * (meta.name_length + 8);
+	if (fseek(out, offset, SEEK_SET)) {
+		WARNING("fseek: %s", strerror(errno));
+		goto end_file;
+	}
+
+	// read/compress files on the thread pool and write them in order
+	struct thread_pool *pool = thread_pool_new(nr_threads);
+	unsigned max_ahead = (nr_threads ? nr_threads : thread_pool_nr_cpus()) * JOBS_PER_THREAD;
+	unsigned submitted = 0;
+	bool ok = true;
+	for (unsigned i = 0; i < n; i++) {
+		while (submitted < n && submitted < i + max_ahead) {
+			thread_pool_submit(pool, create_job_run, &jobs[submitted++]);
+		}
+
+		pthread_mutex_lock(&lock);
+		while (!jobs[i].done)
+			pthread_cond_wait(&cond, &lock);
+		pthread_mutex_unlock(&lock);
+
+		if (ok && !jobs[i].ok)
+			ok = false;
+		if (ok && offset + jobs[i].size > UINT32_MAX) {
+			WARNING("archive too large");
+			ok = false;
+		}
+		if (ok && jobs[i].size && fwrite(jobs[i].data, jobs[i].size, 1, out) != 1) {
+			WARNING("fwrite: %s", strerror(errno));
+			ok = false;
+		}
+		offsets[i] = offset;
+		offset += jobs[i].size;
+		free(jobs[i].data);
+		jobs[i].data = NULL;
+	}
+	thread_pool_free(pool);
+	if (!ok)
+		goto end_file;
+
+	// pick offset/size keys that are detected correctly when reading
+	meta.arc_size = offset;
+	uint32_t seed = 0x5ea7c0de;
+	for (int tries = 0; tries < 64; tries++) {
+		do {
+			meta.offset_key = xorshift32(&seed);
+			meta.size_key = xorshift32(&seed);
+		} while (!meta.offset_key || !meta.size_key);
+		if (!write_header(out, &meta, jobs, offsets))
+			goto end_file;
+		if (check_metadata(out, &meta)) {
+			r = true;
+			break;
+		}
+	}
+	if (!r)
+		WARNING("failed to find usable archive keys");
+end_file:
+	if (fclose(out)) {
+		WARNING("fclose: %s", strerror(errno));
+		r = false;
+	}
+	if (r) {
+#ifdef _WIN32
+		remove(path);
+#endif
+		if (rename(tmp_path, path)) {
+			WARNING("rename: %s", strerror(errno));
+			r = false;
+		}
+	}
+	if (!r)
+		remove(tmp_path);
+	free(tmp_path);
+end_names:
+	for (unsigned i = 0; i < n; i++) {
+		string_free(jobs[i].sjis_name);
+	}
+	free(jobs);
+	free(offsets);
+	return r;
+}
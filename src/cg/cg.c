@@ -21,6 +21,7 @@
 #include "nulib/file.h"
 #include "ai5/arc.h"
 #include "ai5/cg.h"
+#include "convert.h"
 
 struct cg *gp4_decode(uint8_t *data, size_t size);
 struct cg *gp8_decode(uint8_t *data, size_t size);
@@ -57,6 +58,10 @@ enum cg_type cg_type_from_name(const char *name)
 
 struct cg *cg_load_arcdata(struct archive_data *data)
 {
+	// type is determined from the name when the archive index is read, but
+	// entries which didn't come from an archive index may not be classified
+	if (data->type == ARCHIVE_FILE_CG)
+		return cg_load(data->data, data->size, data->cg_type);
 	enum cg_type type = cg_type_from_name(data->name);
 	if (type < 0) {
 		WARNING("Unrecognized CG type: %s", data->name);
@@ -84,16 +89,17 @@ struct cg *cg_copy(struct cg *cg)
 uint8_t *_cg_depalettize(struct cg *cg)
 {
 	assert(cg->palette);
-	uint8_t *px = xmalloc(cg->metrics.w * cg->metrics.h * 4);
-	uint8_t *dst = px;
-	uint8_t *src = cg->pixels;
-	for (int i = 0; i < cg->metrics.w * cg->metrics.h; i++) {
-		uint8_t *color = &cg->palette[*src++ * 4];
-		*dst++ = color[2];
-		*dst++ = color[1];
-		*dst++ = color[0];
-		*dst++ = 255;
+	// BGRx palette to RGBA colors
+	uint32_t lut[256];
+	for (int i = 0; i < 256; i++) {
+		uint8_t *color = &cg->palette[i * 4];
+		uint8_t rgba[4] = { color[2], color[1], color[0], 255 };
+		memcpy(&lut[i], rgba, 4);
 	}
+
+	size_t n = (size_t)cg->metrics.w * cg->metrics.h;
+	uint8_t *px = xmalloc(n * 4);
+	cg_convert_ops()->index_to_rgba(cg->pixels, px, n, lut);
 	return px;
 }
 
@@ -0,0 +1,419 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Pixel format conversion kernels (for decoding and encoding G16/G24/G32).
+ *
+ * Every conversion has a scalar implementation, and on x86 there are also
+ * SSE2, SSSE3 and AVX2 versions where the instruction set helps. The vector
+ * kernels give exactly the same output as the scalar ones: they convert as
+ * many whole vectors as fit in the row without reading past its end and
+ * leave the remaining pixels to the scalar code. The AVX2 kernels clear the
+ * upper halves of the registers before handing the rest of a row to the SSE
+ * kernels, to avoid the penalty for mixing the two.
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "nulib.h"
+#include "nulib/little_endian.h"
+#include "convert.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#define attr_target(isa) __attribute__((target(isa)))
+#endif
+
+static void bgr555_to_rgba_scalar(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	for (unsigned col = 0; col < w; col++) {
+		uint16_t c = le_get16(px, col * 2);
+		*out++ = (c & 0x7c00) >> 7;
+		*out++ = (c & 0x03e0) >> 2;
+		*out++ = (c & 0x001f) << 3;
+		*out++ = 0xff;
+	}
+}
+
+static void bgr_to_rgba_scalar(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	for (unsigned col = 0; col < w; col++) {
+		*out++ = px[col * 3 + 2];
+		*out++ = px[col * 3 + 1];
+		*out++ = px[col * 3 + 0];
+		*out++ = 0xff;
+	}
+}
+
+static void bgra_to_rgba_scalar(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	for (unsigned col = 0; col < w; col++) {
+		*out++ = px[col * 4 + 2];
+		*out++ = px[col * 4 + 1];
+		*out++ = px[col * 4 + 0];
+		*out++ = px[col * 4 + 3];
+	}
+}
+
+static void rgba_to_bgr555_scalar(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	for (unsigned col = 0; col < w; col++, px += 4) {
+		uint16_t c = 0;
+		c |= (px[0] & 0xf8) << 7;
+		c |= (px[1] & 0xf8) << 2;
+		c |= (px[2] & 0xf8) >> 3;
+		le_put16(out, col * 2, c);
+	}
+}
+
+static void rgba_to_bgr_scalar(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	for (unsigned col = 0; col < w; col++, px += 4) {
+		out[col * 3 + 2] = px[0];
+		out[col * 3 + 1] = px[1];
+		out[col * 3 + 0] = px[2];
+	}
+}
+
+static void index_to_rgba_scalar(const uint8_t *px, uint8_t *out, size_t n,
+		const uint32_t *lut)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		uint32_t c0 = lut[px[i + 0]];
+		uint32_t c1 = lut[px[i + 1]];
+		uint32_t c2 = lut[px[i + 2]];
+		uint32_t c3 = lut[px[i + 3]];
+		memcpy(out + i * 4 + 0, &c0, 4);
+		memcpy(out + i * 4 + 4, &c1, 4);
+		memcpy(out + i * 4 + 8, &c2, 4);
+		memcpy(out + i * 4 + 12, &c3, 4);
+	}
+	for (; i < n; i++) {
+		memcpy(out + i * 4, &lut[px[i]], 4);
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+
+/*
+ * BGR555 is expanded in 16-bit lanes: each channel is shifted to the top of
+ * the low byte and masked, then R|G<<8 and B|0xff00 are interleaved into
+ * RGBA pixels.
+ */
+attr_target("sse2")
+static void bgr555_to_rgba_sse2(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	const __m128i mask = _mm_set1_epi16(0xf8);
+	const __m128i alpha = _mm_set1_epi16((short)0xff00);
+	unsigned col = 0;
+	for (; col + 8 <= w; col += 8) {
+		__m128i c = _mm_loadu_si128((const __m128i*)(px + col * 2));
+		__m128i r = _mm_and_si128(_mm_srli_epi16(c, 7), mask);
+		__m128i g = _mm_and_si128(_mm_srli_epi16(c, 2), mask);
+		__m128i b = _mm_and_si128(_mm_slli_epi16(c, 3), mask);
+		__m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+		__m128i ba = _mm_or_si128(b, alpha);
+		_mm_storeu_si128((__m128i*)(out + col * 4), _mm_unpacklo_epi16(rg, ba));
+		_mm_storeu_si128((__m128i*)(out + col * 4 + 16), _mm_unpackhi_epi16(rg, ba));
+	}
+	bgr555_to_rgba_scalar(px + col * 2, out + col * 4, w - col);
+}
+
+attr_target("avx2")
+static void bgr555_to_rgba_avx2(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	const __m256i mask = _mm256_set1_epi16(0xf8);
+	const __m256i alpha = _mm256_set1_epi16((short)0xff00);
+	unsigned col = 0;
+	for (; col + 16 <= w; col += 16) {
+		__m256i c = _mm256_loadu_si256((const __m256i*)(px + col * 2));
+		__m256i r = _mm256_and_si256(_mm256_srli_epi16(c, 7), mask);
+		__m256i g = _mm256_and_si256(_mm256_srli_epi16(c, 2), mask);
+		__m256i b = _mm256_and_si256(_mm256_slli_epi16(c, 3), mask);
+		__m256i rg = _mm256_or_si256(r, _mm256_slli_epi16(g, 8));
+		__m256i ba = _mm256_or_si256(b, alpha);
+		// unpacking works within 128-bit lanes: lo holds pixels 0-3 and
+		// 8-11, hi holds 4-7 and 12-15
+		__m256i lo = _mm256_unpacklo_epi16(rg, ba);
+		__m256i hi = _mm256_unpackhi_epi16(rg, ba);
+		_mm256_storeu_si256((__m256i*)(out + col * 4), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i*)(out + col * 4 + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	_mm256_zeroupper();
+	bgr555_to_rgba_sse2(px + col * 2, out + col * 4, w - col);
+}
+
+/*
+ * BGR is loaded 16 bytes at a time, of which 12 (4 pixels) are shuffled into
+ * RGBA with zeros in place of alpha, which is then ORed in.
+ */
+#define BGR_SHUFFLE 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1
+
+attr_target("ssse3")
+static void bgr_to_rgba_ssse3(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	const __m128i shuf = _mm_setr_epi8(BGR_SHUFFLE);
+	const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+	unsigned col = 0;
+	// the last load reads 16 bytes for 4 pixels
+	for (; col + 6 <= w; col += 4) {
+		__m128i c = _mm_loadu_si128((const __m128i*)(px + col * 3));
+		c = _mm_or_si128(_mm_shuffle_epi8(c, shuf), alpha);
+		_mm_storeu_si128((__m128i*)(out + col * 4), c);
+	}
+	bgr_to_rgba_scalar(px + col * 3, out + col * 4, w - col);
+}
+
+attr_target("avx2")
+static void bgr_to_rgba_avx2(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	const __m256i shuf = _mm256_setr_epi8(BGR_SHUFFLE, BGR_SHUFFLE);
+	const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+	unsigned col = 0;
+	// 4 pixels per lane; the last load reads 16 bytes for 4 pixels
+	for (; col + 10 <= w; col += 8) {
+		const uint8_t *p = px + col * 3;
+		__m256i c = _mm256_inserti128_si256(
+				_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+				_mm_loadu_si128((const __m128i*)(p + 12)), 1);
+		c = _mm256_or_si256(_mm256_shuffle_epi8(c, shuf), alpha);
+		_mm256_storeu_si256((__m256i*)(out + col * 4), c);
+	}
+	_mm256_zeroupper();
+	bgr_to_rgba_ssse3(px + col * 3, out + col * 4, w - col);
+}
+
+/*
+ * BGRA to RGBA swaps bytes 0 and 2 of each pixel: with masks and shifts on
+ * SSE2, and a single shuffle on SSSE3 and up.
+ */
+attr_target("sse2")
+static void bgra_to_rgba_sse2(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	const __m128i ga = _mm_set1_epi32((int)0xff00ff00);
+	const __m128i lo = _mm_set1_epi32(0xff);
+	unsigned col = 0;
+	for (; col + 4 <= w; col += 4) {
+		__m128i c = _mm_loadu_si128((const __m128i*)(px + col * 4));
+		__m128i r = _mm_and_si128(_mm_srli_epi32(c, 16), lo);
+		__m128i b = _mm_slli_epi32(_mm_and_si128(c, lo), 16);
+		c = _mm_or_si128(_mm_and_si128(c, ga), _mm_or_si128(r, b));
+		_mm_storeu_si128((__m128i*)(out + col * 4), c);
+	}
+	bgra_to_rgba_scalar(px + col * 4, out + col * 4, w - col);
+}
+
+#define BGRA_SHUFFLE 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15
+
+attr_target("ssse3")
+static void bgra_to_rgba_ssse3(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	const __m128i shuf = _mm_setr_epi8(BGRA_SHUFFLE);
+	unsigned col = 0;
+	for (; col + 4 <= w; col += 4) {
+		__m128i c = _mm_loadu_si128((const __m128i*)(px + col * 4));
+		_mm_storeu_si128((__m128i*)(out + col * 4), _mm_shuffle_epi8(c, shuf));
+	}
+	bgra_to_rgba_scalar(px + col * 4, out + col * 4, w - col);
+}
+
+attr_target("avx2")
+static void bgra_to_rgba_avx2(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	const __m256i shuf = _mm256_setr_epi8(BGRA_SHUFFLE, BGRA_SHUFFLE);
+	unsigned col = 0;
+	for (; col + 8 <= w; col += 8) {
+		__m256i c = _mm256_loadu_si256((const __m256i*)(px + col * 4));
+		_mm256_storeu_si256((__m256i*)(out + col * 4), _mm256_shuffle_epi8(c, shuf));
+	}
+	_mm256_zeroupper();
+	bgra_to_rgba_ssse3(px + col * 4, out + col * 4, w - col);
+}
+
+/*
+ * RGBA to BGR555 works on whole pixels in 32-bit lanes, where R, G and B are
+ * bits 3-7, 11-15 and 19-23: each is masked and shifted into place, and the
+ * (15-bit) results are packed into 16-bit lanes.
+ */
+attr_target("sse2")
+static void rgba_to_bgr555_sse2(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	const __m128i r_mask = _mm_set1_epi32(0xf8);
+	const __m128i g_mask = _mm_set1_epi32(0xf800);
+	const __m128i b_mask = _mm_set1_epi32(0xf80000);
+	unsigned col = 0;
+	for (; col + 8 <= w; col += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(px + col * 4));
+		__m128i b = _mm_loadu_si128((const __m128i*)(px + col * 4 + 16));
+		a = _mm_or_si128(_mm_or_si128(
+				_mm_slli_epi32(_mm_and_si128(a, r_mask), 7),
+				_mm_srli_epi32(_mm_and_si128(a, g_mask), 6)),
+				_mm_srli_epi32(_mm_and_si128(a, b_mask), 19));
+		b = _mm_or_si128(_mm_or_si128(
+				_mm_slli_epi32(_mm_and_si128(b, r_mask), 7),
+				_mm_srli_epi32(_mm_and_si128(b, g_mask), 6)),
+				_mm_srli_epi32(_mm_and_si128(b, b_mask), 19));
+		_mm_storeu_si128((__m128i*)(out + col * 2), _mm_packs_epi32(a, b));
+	}
+	rgba_to_bgr555_scalar(px + col * 4, out + col * 2, w - col);
+}
+
+attr_target("avx2")
+static void rgba_to_bgr555_avx2(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	const __m256i r_mask = _mm256_set1_epi32(0xf8);
+	const __m256i g_mask = _mm256_set1_epi32(0xf800);
+	const __m256i b_mask = _mm256_set1_epi32(0xf80000);
+	unsigned col = 0;
+	for (; col + 16 <= w; col += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(px + col * 4));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(px + col * 4 + 32));
+		a = _mm256_or_si256(_mm256_or_si256(
+				_mm256_slli_epi32(_mm256_and_si256(a, r_mask), 7),
+				_mm256_srli_epi32(_mm256_and_si256(a, g_mask), 6)),
+				_mm256_srli_epi32(_mm256_and_si256(a, b_mask), 19));
+		b = _mm256_or_si256(_mm256_or_si256(
+				_mm256_slli_epi32(_mm256_and_si256(b, r_mask), 7),
+				_mm256_srli_epi32(_mm256_and_si256(b, g_mask), 6)),
+				_mm256_srli_epi32(_mm256_and_si256(b, b_mask), 19));
+		// packing works within 128-bit lanes
+		__m256i c = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+		_mm256_storeu_si256((__m256i*)(out + col * 2), c);
+	}
+	_mm256_zeroupper();
+	rgba_to_bgr555_sse2(px + col * 4, out + col * 2, w - col);
+}
+
+/*
+ * RGBA to BGR shuffles each group of 4 pixels into 12 bytes at the bottom of
+ * the register. On SSSE3, 4 groups are then combined with byte shifts into 3
+ * stores; on AVX2, the two groups of a register are moved together and
+ * stored with a 32-byte store whose last 8 bytes are overwritten by the next
+ * store.
+ */
+#define RGB_SHUFFLE 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+attr_target("ssse3")
+static void rgba_to_bgr_ssse3(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	const __m128i shuf = _mm_setr_epi8(RGB_SHUFFLE);
+	unsigned col = 0;
+	for (; col + 16 <= w; col += 16) {
+		const __m128i *p = (const __m128i*)(px + col * 4);
+		__m128i a = _mm_shuffle_epi8(_mm_loadu_si128(p), shuf);
+		__m128i b = _mm_shuffle_epi8(_mm_loadu_si128(p + 1), shuf);
+		__m128i c = _mm_shuffle_epi8(_mm_loadu_si128(p + 2), shuf);
+		__m128i d = _mm_shuffle_epi8(_mm_loadu_si128(p + 3), shuf);
+		__m128i *o = (__m128i*)(out + col * 3);
+		_mm_storeu_si128(o, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+		_mm_storeu_si128(o + 1, _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+		_mm_storeu_si128(o + 2, _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+	}
+	rgba_to_bgr_scalar(px + col * 4, out + col * 3, w - col);
+}
+
+attr_target("avx2")
+static void rgba_to_bgr_avx2(const uint8_t *px, uint8_t *out, unsigned w)
+{
+	const __m256i shuf = _mm256_setr_epi8(RGB_SHUFFLE, RGB_SHUFFLE);
+	const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+	unsigned col = 0;
+	// the last store writes 32 bytes for 8 pixels
+	for (; col + 11 <= w; col += 8) {
+		__m256i c = _mm256_loadu_si256((const __m256i*)(px + col * 4));
+		c = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(c, shuf), pack);
+		_mm256_storeu_si256((__m256i*)(out + col * 3), c);
+	}
+	_mm256_zeroupper();
+	rgba_to_bgr_ssse3(px + col * 4, out + col * 3, w - col);
+}
+
+/*
+ * Indices are widened to 32 bits and the colors gathered from the table, 8
+ * pixels at a time.
+ */
+attr_target("avx2")
+static void index_to_rgba_avx2(const uint8_t *px, uint8_t *out, size_t n,
+		const uint32_t *lut)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i idx = _mm_loadu_si128((const __m128i*)(px + i));
+		__m256i a = _mm256_cvtepu8_epi32(idx);
+		__m256i b = _mm256_cvtepu8_epi32(_mm_srli_si128(idx, 8));
+		a = _mm256_i32gather_epi32((const int*)lut, a, 4);
+		b = _mm256_i32gather_epi32((const int*)lut, b, 4);
+		_mm256_storeu_si256((__m256i*)(out + i * 4), a);
+		_mm256_storeu_si256((__m256i*)(out + i * 4 + 32), b);
+	}
+	_mm256_zeroupper();
+	index_to_rgba_scalar(px + i, out + i * 4, n - i, lut);
+}
+
+#endif // HAVE_X86_SIMD
+
+void cg_convert_select(struct cg_convert_ops *ops, unsigned isa)
+{
+	*ops = (struct cg_convert_ops) {
+		.bgr555_to_rgba = bgr555_to_rgba_scalar,
+		.bgr_to_rgba = bgr_to_rgba_scalar,
+		.bgra_to_rgba = bgra_to_rgba_scalar,
+		.rgba_to_bgr555 = rgba_to_bgr555_scalar,
+		.rgba_to_bgr = rgba_to_bgr_scalar,
+		// swapping R and B works both ways
+		.rgba_to_bgra = bgra_to_rgba_scalar,
+		.index_to_rgba = index_to_rgba_scalar,
+	};
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if ((isa & CG_CONVERT_SSE2) && __builtin_cpu_supports("sse2")) {
+		ops->bgr555_to_rgba = bgr555_to_rgba_sse2;
+		ops->bgra_to_rgba = bgra_to_rgba_sse2;
+		ops->rgba_to_bgr555 = rgba_to_bgr555_sse2;
+	}
+	if ((isa & CG_CONVERT_SSSE3) && __builtin_cpu_supports("ssse3")) {
+		ops->bgr_to_rgba = bgr_to_rgba_ssse3;
+		ops->bgra_to_rgba = bgra_to_rgba_ssse3;
+		ops->rgba_to_bgr = rgba_to_bgr_ssse3;
+	}
+	if ((isa & CG_CONVERT_AVX2) && __builtin_cpu_supports("avx2")) {
+		ops->bgr555_to_rgba = bgr555_to_rgba_avx2;
+		ops->bgr_to_rgba = bgr_to_rgba_avx2;
+		ops->bgra_to_rgba = bgra_to_rgba_avx2;
+		ops->rgba_to_bgr555 = rgba_to_bgr555_avx2;
+		ops->rgba_to_bgr = rgba_to_bgr_avx2;
+		ops->index_to_rgba = index_to_rgba_avx2;
+	}
+	ops->rgba_to_bgra = ops->bgra_to_rgba;
+#endif
+}
+
+static struct cg_convert_ops ops;
+static pthread_once_t ops_once = PTHREAD_ONCE_INIT;
+
+static void cg_convert_init(void)
+{
+	cg_convert_select(&ops, CG_CONVERT_ALL);
+}
+
+const struct cg_convert_ops *cg_convert_ops(void)
+{
+	pthread_once(&ops_once, cg_convert_init);
+	return &ops;
+}
@@ -0,0 +1,65 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef AI5_CG_CONVERT_H
+#define AI5_CG_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Pixel format conversions, one row of `w` (or any `n`) pixels at a time.
+ */
+struct cg_convert_ops {
+	// 16-bit BGR555 to RGBA
+	void (*bgr555_to_rgba)(const uint8_t *px, uint8_t *out, unsigned w);
+	// 24-bit BGR to RGBA
+	void (*bgr_to_rgba)(const uint8_t *px, uint8_t *out, unsigned w);
+	// 32-bit BGRA to RGBA
+	void (*bgra_to_rgba)(const uint8_t *px, uint8_t *out, unsigned w);
+	// RGBA to 16-bit BGR555 (dropping the low bits and alpha)
+	void (*rgba_to_bgr555)(const uint8_t *px, uint8_t *out, unsigned w);
+	// RGBA to 24-bit BGR (dropping alpha)
+	void (*rgba_to_bgr)(const uint8_t *px, uint8_t *out, unsigned w);
+	// RGBA to 32-bit BGRA
+	void (*rgba_to_bgra)(const uint8_t *px, uint8_t *out, unsigned w);
+	// 8-bit indices to RGBA, through a table of 256 RGBA colors
+	void (*index_to_rgba)(const uint8_t *px, uint8_t *out, size_t n,
+			const uint32_t *lut);
+};
+
+// instruction set extensions for `cg_convert_select`
+enum {
+	CG_CONVERT_SSE2  = 1,
+	CG_CONVERT_SSSE3 = 2,
+	CG_CONVERT_AVX2  = 4,
+	CG_CONVERT_ALL   = 7,
+};
+
+/*
+ * Get the fastest conversions that use only the given instruction set
+ * extensions (of those supported by the CPU). With `isa` = 0 this is the
+ * scalar code, which the tests compare the other kernels against.
+ */
+void cg_convert_select(struct cg_convert_ops *ops, unsigned isa);
+
+/*
+ * Get the fastest conversions supported by the CPU. The choice is made on the
+ * first call.
+ */
+const struct cg_convert_ops *cg_convert_ops(void);
+
+#endif // AI5_CG_CONVERT_H
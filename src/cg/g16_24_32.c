@@ -20,139 +20,53 @@
 
 #include "nulib.h"
 #include "nulib/little_endian.h"
-#include "nulib/lzss.h"
 #include "ai5/cg.h"
+#include "ai5/lzss.h"
+#include "convert.h"
 
 static unsigned gxx_stride(struct cg_metrics *metrics)
 {
 	return ((metrics->bpp / 8) * metrics->w + 3) & ~3;
 }
 
-static uint8_t *bgr555_to_rgba(uint8_t *data, size_t size, struct cg_metrics *metrics)
-{
-	unsigned stride = gxx_stride(metrics);
-	if (size != stride * metrics->h) {
-		WARNING("Unexpected size for CG: expected %u; got %u",
-				stride * metrics->h, (unsigned)size);
-		return NULL;
-	}
-
-	uint8_t *out = xmalloc(metrics->w * metrics->h * 4);
-	uint8_t *out_p = out;
-	for (int row = metrics->h - 1; row >= 0; row--) {
-		uint8_t *px = data + stride * row;
-		for (int col = 0; col < metrics->w; col++) {
-			uint16_t c = le_get16(px, col * 2);
-			*out_p++ = (c & 0x7c00) >> 7;
-			*out_p++ = (c & 0x03e0) >> 2;
-			*out_p++ = (c & 0x001f) << 3;
-			*out_p++ = 0xff;
-		}
-	}
-
-	return out;
-}
-
-static uint8_t *rgba_to_bgr555(uint8_t *data, struct cg_metrics *metrics)
+/*
+ * Convert RGBA pixels to bottom-up rows of the format of `metrics`. The row
+ * padding is zeroed.
+ */
+static uint8_t *rgba_to_gxx(uint8_t *data, struct cg_metrics *metrics,
+		void (*convert)(const uint8_t *px, uint8_t *out, unsigned w))
 {
 	unsigned stride = gxx_stride(metrics);
 	uint8_t *out = xcalloc(metrics->h, stride);
 	for (int row = metrics->h - 1; row >= 0; row--) {
-		uint8_t *out_p = out + stride * row;
-		for (int col = 0; col < metrics->w; col++) {
-			uint16_t c = 0;
-			c |= (*data++ & 0xf8) << 7;
-			c |= (*data++ & 0xf8) << 2;
-			c |= (*data++ & 0xf8) >> 3;
-			data++; // drop alpha
-			le_put16(out_p, col * 2, c);
-		}
-	}
-	return out;
-}
-
-static uint8_t *bgr_to_rgba(uint8_t *data, size_t size, struct cg_metrics *metrics)
-{
-	unsigned stride = gxx_stride(metrics);
-	if (size != stride * metrics->h) {
-		WARNING("Unexpected size for CG: expected %u; got %u",
-				stride * metrics->h, (unsigned)size);
-		return NULL;
-	}
-
-	uint8_t *out = xmalloc(metrics->w * metrics->h * 4);
-	uint8_t *out_p = out;
-	for (int row = metrics->h - 1; row >= 0; row--) {
-		uint8_t *px = data + stride * row;
-		for (int col = 0; col < metrics->w; col++) {
-			*out_p++ = px[col * 3 + 2];
-			*out_p++ = px[col * 3 + 1];
-			*out_p++ = px[col * 3 + 0];
-			*out_p++ = 0xff;
-		}
-	}
-
-	return out;
-}
-
-static uint8_t *rgba_to_bgr(uint8_t *data, struct cg_metrics *metrics)
-{
-	unsigned stride = gxx_stride(metrics);
-	uint8_t *out = xmalloc(metrics->h * stride);
-	for (int row = metrics->h - 1; row >= 0; row--) {
-		uint8_t *out_p = out + stride * row;
-		for (int col = 0; col < metrics->w; col++) {
-			out_p[col * 3 + 2] = *data++;
-			out_p[col * 3 + 1] = *data++;
-			out_p[col * 3 + 0] = *data++;
-			data++; // drop alpha
-		}
-	}
-	return out;
-}
-
-static uint8_t *bgra_to_rgba(uint8_t *data, size_t size, struct cg_metrics *metrics)
-{
-	unsigned stride = gxx_stride(metrics);
-	if (size != stride * metrics->h) {
-		WARNING("Unexpected size for CG: expected %u; got %u",
-				stride * metrics->h, (unsigned)size);
-		return NULL;
-	}
-
-	uint8_t *out = xmalloc(metrics->w * metrics->h * 4);
-	uint8_t *out_p = out;
-	for (int row = metrics->h - 1; row >= 0; row--) {
-		uint8_t *px = data + stride * row;
-		for (int col = 0; col < metrics->w; col++) {
-			*out_p++ = px[col * 4 + 2];
-			*out_p++ = px[col * 4 + 1];
-			*out_p++ = px[col * 4 + 0];
-			*out_p++ = px[col * 4 + 3];;
-		}
+		convert(data, out + stride * row, metrics->w);
+		data += metrics->w * 4;
 	}
-
 	return out;
 }
 
-static uint8_t *rgba_to_bgra(uint8_t *data, struct cg_metrics *metrics)
-{
-	unsigned stride = gxx_stride(metrics);
-	uint8_t *out = xmalloc(metrics->h * stride);
-	for (int row = metrics->h - 1; row >= 0; row--) {
-		uint8_t *out_p = out + stride * row;
-		for (int col = 0; col < metrics->w; col++) {
-			out_p[col * 4 + 2] = *data++;
-			out_p[col * 4 + 1] = *data++;
-			out_p[col * 4 + 0] = *data++;
-			out_p[col * 4 + 3] = *data++;
-		}
-	}
-	return out;
-}
+/*
+ * Pixel data is decompressed into a window holding the LZSS history (the last
+ * 4096 bytes) and a batch of rows, and each (bottom-up) row is converted into
+ * its place in the image as soon as it is complete. The window is refilled by
+ * moving the history and any partial row to the front.
+ */
+#define GXX_BATCH_SIZE (32 * 1024)
+#define GXX_HISTORY 4096
 
 struct cg *gxx_decode(uint8_t *data, size_t size, unsigned bpp)
 {
+	const struct cg_convert_ops *ops = cg_convert_ops();
+	void (*convert)(const uint8_t *px, uint8_t *out, unsigned w);
+	if (bpp == 16)
+		convert = ops->bgr555_to_rgba;
+	else if (bpp == 24)
+		convert = ops->bgr_to_rgba;
+	else if (bpp == 32)
+		convert = ops->bgra_to_rgba;
+	else
+		ERROR("unsupported bpp: %u", bpp);
+
 	struct cg *cg = xcalloc(1, sizeof(struct cg));
 	cg->metrics.x = le_get16(data, 0);
 	cg->metrics.y = le_get16(data, 2);
@@ -161,24 +75,59 @@ struct cg *gxx_decode(uint8_t *data, size_t size, unsigned bpp)
 	cg->metrics.bpp = bpp;
 	cg->metrics.has_alpha = false;
 
-	size_t px_size;
-	uint8_t *px_data = lzss_decompress(data+8, size-8, &px_size);
-
-	if (bpp == 16)
-		cg->pixels = bgr555_to_rgba(px_data, px_size, &cg->metrics);
-	else if (bpp == 24)
-		cg->pixels = bgr_to_rgba(px_data, px_size, &cg->metrics);
-	else if (bpp == 32)
-		cg->pixels = bgra_to_rgba(px_data, px_size, &cg->metrics);
-	else
-		ERROR("unsupported bpp: %u", bpp);
+	unsigned w = cg->metrics.w;
+	unsigned h = cg->metrics.h;
+	size_t stride = gxx_stride(&cg->metrics);
+	size_t batch = stride > GXX_BATCH_SIZE ? stride : GXX_BATCH_SIZE;
+	size_t buf_size = (stride > GXX_HISTORY ? stride : GXX_HISTORY) + batch
+		+ AI5_LZSS_DECODE_SLACK;
+	uint8_t *buf = xmalloc(buf_size);
+	cg->pixels = xmalloc(w * h * 4);
+
+	struct ai5_lzss_decoder d;
+	ai5_lzss_decoder_init(&d, data+8, size-8);
+	size_t len = 0;     // bytes in `buf`
+	size_t row_pos = 0; // offset of the next row in `buf`
+	unsigned row = 0;
+	for (;;) {
+		for (; row < h && len - row_pos >= stride; row++, row_pos += stride) {
+			convert(buf + row_pos, cg->pixels + (size_t)(h - 1 - row) * w * 4, w);
+		}
+		if (row == h && len > row_pos)
+			break;
+		if (len + batch + AI5_LZSS_DECODE_SLACK > buf_size) {
+			// drop everything before the history and the partial row
+			size_t drop = len > GXX_HISTORY ? len - GXX_HISTORY : 0;
+			if (drop > row_pos)
+				drop = row_pos;
+			memmove(buf, buf + drop, len - drop);
+			len -= drop;
+			row_pos -= drop;
+		}
+		size_t n = ai5_lzss_decode(&d, buf, len, batch);
+		if (!n)
+			break;
+		len += n;
+	}
 
-	free(px_data);
-	if (!cg->pixels) {
-		free(cg);
-		return NULL;
+	if (row < h) {
+		WARNING("Unexpected size for CG: expected %u; got %u",
+				(unsigned)(stride * h), (unsigned)d.out_pos);
+		goto error;
 	}
+	if (len > row_pos) {
+		WARNING("Unexpected size for CG: expected %u; got more",
+				(unsigned)(stride * h));
+		goto error;
+	}
+
+	free(buf);
 	return cg;
+error:
+	free(buf);
+	free(cg->pixels);
+	free(cg);
+	return NULL;
 }
 
 static bool write_u16(FILE *out, uint32_t v)
@@ -194,21 +143,23 @@ static bool write_u16(FILE *out, uint32_t v)
 
 bool gxx_write(struct cg *cg, FILE *out, unsigned bpp)
 {
+	const struct cg_convert_ops *ops = cg_convert_ops();
 	uint8_t *data;
 	struct cg_metrics metrics = cg->metrics;
 	metrics.bpp = bpp;
 	size_t data_size = gxx_stride(&metrics) * metrics.h;
 	if (bpp == 16)
-		data = rgba_to_bgr555(cg->pixels, &metrics);
+		data = rgba_to_gxx(cg->pixels, &metrics, ops->rgba_to_bgr555);
 	else if (bpp == 24)
-		data = rgba_to_bgr(cg->pixels, &metrics);
+		data = rgba_to_gxx(cg->pixels, &metrics, ops->rgba_to_bgr);
 	else if (bpp == 32)
-		data = rgba_to_bgra(cg->pixels, &metrics);
+		data = rgba_to_gxx(cg->pixels, &metrics, ops->rgba_to_bgra);
 	else
 		ERROR("unsupported bpp: %u", bpp);
 
 	size_t zipped_size;
-	uint8_t *zipped = lzss_compress(data, data_size, &zipped_size);
+	uint8_t *zipped = ai5_lzss_compress_mt(data, data_size, &zipped_size,
+			AI5_LZSS_DEFAULT_LEVEL, 0);
 	free(data);
 
 	if (!write_u16(out, metrics.x)) return false;
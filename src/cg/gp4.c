@@ -19,6 +19,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "nulib.h"
 #include "nulib/little_endian.h"
@@ -31,42 +32,96 @@
 #define DECODE_PIXEL 0
 #define DECODE_RLE   1
 
+/*
+ * MSB-first bit reader. Up to 64 bits are buffered at a time and refilled 8
+ * bytes at a time (byte by byte near the end of the data). Reading past the
+ * end of the data yields zeros.
+ */
 struct bitstream {
 	uint8_t *data;
-	unsigned size;
-	unsigned byte_index;
-	uint8_t bit_index;
-	bool warned;
+	size_t size;
+	size_t pos;    // next byte to shift into `buf` (may be past the end)
+	uint64_t buf;  // unread bits, starting at the top
+	unsigned bits; // number of unread bits in `buf`
 };
 
-uint8_t bitstream_read_bit(struct bitstream *b)
+static inline uint64_t load_be64(const uint8_t *p)
 {
-	if (b->byte_index >= b->size) {
-		if (!b->warned) {
-			WARNING("Attempted to read beyond end of file");
-			b->warned = true;
-		}
-		return 0;
+	return (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48 | (uint64_t)p[2] << 40
+		| (uint64_t)p[3] << 32 | (uint64_t)p[4] << 24 | (uint64_t)p[5] << 16
+		| (uint64_t)p[6] << 8 | (uint64_t)p[7];
+}
+
+/*
+ * Top up the buffer to at least 56 bits.
+ */
+static inline void bitstream_refill(struct bitstream *b)
+{
+	if (b->pos + 8 <= b->size) {
+		// the bits below the last whole byte are loaded again next time
+		b->buf |= load_be64(b->data + b->pos) >> b->bits;
+		b->pos += (63 - b->bits) >> 3;
+		b->bits |= 56;
+		return;
 	}
-	uint8_t bit = (b->data[b->byte_index] >> b->bit_index) & 1;
-	if (b->bit_index == 0) {
-		b->bit_index = 7;
-		b->byte_index++;
-	} else {
-		b->bit_index--;
+	while (b->bits <= 56) {
+		if (b->pos < b->size)
+			b->buf |= (uint64_t)b->data[b->pos] << (56 - b->bits);
+		b->pos++;
+		b->bits += 8;
 	}
-	return bit;
 }
 
-uint16_t bitstream_read_bits(struct bitstream *b, uint8_t n)
+/*
+ * Look at the next `n` (at most 32) bits without consuming them.
+ */
+static inline unsigned bitstream_peek_bits(struct bitstream *b, unsigned n)
 {
-	uint16_t bits = 0;
-	for (int i = 0; i < n; i++) {
-		bits = (bits << 1) | bitstream_read_bit(b);
-	}
+	if (b->bits < n)
+		bitstream_refill(b);
+	return b->buf >> (64 - n);
+}
+
+static inline void bitstream_skip_bits(struct bitstream *b, unsigned n)
+{
+	b->buf <<= n;
+	b->bits -= n;
+}
+
+static inline unsigned bitstream_read_bits(struct bitstream *b, unsigned n)
+{
+	unsigned bits = bitstream_peek_bits(b, n);
+	bitstream_skip_bits(b, n);
 	return bits;
 }
 
+static inline unsigned bitstream_read_bit(struct bitstream *b)
+{
+	return bitstream_read_bits(b, 1);
+}
+
+/*
+ * Read a run of 1 bits and the 0 bit that ends it, returning the length of
+ * the run. Runs are at most 15 bits long (longer runs only occur in corrupt
+ * data, and are cut short).
+ */
+static inline unsigned bitstream_read_ones(struct bitstream *b)
+{
+	if (b->bits < 16)
+		bitstream_refill(b);
+	unsigned n = __builtin_clzll(~b->buf | (1ull << 48));
+	bitstream_skip_bits(b, n + 1);
+	return n;
+}
+
+/*
+ * Check whether more bits were read than the data holds.
+ */
+static bool bitstream_overrun(struct bitstream *b)
+{
+	return b->pos * 8 - b->bits > b->size * 8;
+}
+
 void cg_write_px(struct cg *cg, unsigned x, unsigned y, uint8_t color)
 {
 	if (x >= cg->metrics.w || y >= cg->metrics.h) {
@@ -85,27 +140,87 @@ uint8_t cg_get_px(struct cg *cg, unsigned x, unsigned y)
 	return cg->pixels[y * cg->metrics.w + x];
 }
 
+/*
+ * The RLE position and length codes are decoded by looking up the next 8 or
+ * 9 bits in a table, which covers all lengths and all positions except those
+ * with long runs of 1 bits (horizontal offsets of 16 pixels or more).
+ */
+#define RLE_POS_BITS 8
+#define RLE_LENGTH_BITS 9
+#define RLE_LENGTH_ESCAPE 79
+
+struct rle_pos_code {
+	uint8_t len; // code length in bits, or 0 if longer than RLE_POS_BITS
+	uint8_t hori;
+	int8_t vert;
+};
+
+struct rle_length_code {
+	uint8_t len;
+	uint8_t length; // RLE_LENGTH_ESCAPE if followed by a 10-bit length
+};
+
+static struct rle_pos_code rle_pos_table[1 << RLE_POS_BITS];
+static struct rle_length_code rle_length_table[1 << RLE_LENGTH_BITS];
+static pthread_once_t rle_tables_once = PTHREAD_ONCE_INIT;
+
+static void rle_tables_init(void)
+{
+	for (unsigned t = 0; t < (1 << RLE_POS_BITS); t++) {
+		struct rle_pos_code *c = &rle_pos_table[t];
+		if (!(t & 0x80)) {
+			// 0vvvv
+			*c = (struct rle_pos_code) { 5, 1, (int)((t >> 3) & 0xf) - 8 };
+		} else if (!(t & 0x40)) {
+			// 10vvv: -16 and -8 take the place of -8 and -7
+			int vert = (int)((t >> 3) & 0x7) - 8;
+			if (vert <= -7)
+				vert = vert == -7 ? -8 : -16;
+			*c = (struct rle_pos_code) { 5, 0, vert };
+		} else if (!(t & 0x20)) {
+			// 110vvvv
+			*c = (struct rle_pos_code) { 7, 2, (int)((t >> 1) & 0xf) - 8 };
+		} else if (!(t & 0x10)) {
+			// 1110vvvv
+			*c = (struct rle_pos_code) { 8, 3, (int)(t & 0xf) - 8 };
+		} else {
+			*c = (struct rle_pos_code) { 0, 0, 0 };
+		}
+	}
+	for (unsigned t = 0; t < (1 << RLE_LENGTH_BITS); t++) {
+		struct rle_length_code *c = &rle_length_table[t];
+		if (!(t & 0x100)) {
+			// 0v
+			*c = (struct rle_length_code) { 2, 2 + ((t >> 7) & 0x1) };
+		} else if (!(t & 0x80)) {
+			// 10vv
+			*c = (struct rle_length_code) { 4, 4 + ((t >> 5) & 0x3) };
+		} else if (!(t & 0x40)) {
+			// 110vvv
+			*c = (struct rle_length_code) { 6, 8 + ((t >> 3) & 0x7) };
+		} else {
+			// 111vvvvvv
+			*c = (struct rle_length_code) { 9, 16 + (t & 0x3f) };
+		}
+	}
+}
+
 static void decode_rle_pos(struct bitstream *b, int *x, int *y)
 {
 	int hori, vert;
-	if (bitstream_read_bit(b) == 0) {
-		hori = 1;
-		vert = (int)(bitstream_read_bits(b, 4) - 8);
-	} else if (bitstream_read_bit(b) == 0) {
-		hori = 0;
-		vert = (int)(bitstream_read_bits(b, 3) - 8);
-		if (vert <= -7) {
-			if (vert == -7) {
-				vert = 0;
-			}
-			vert = vert - 8;
-		}
+	struct rle_pos_code c = rle_pos_table[bitstream_peek_bits(b, RLE_POS_BITS)];
+	if (c.len) {
+		bitstream_skip_bits(b, c.len);
+		hori = c.hori;
+		vert = c.vert;
 	} else {
+		// 11, a run of 1 bits, 0, vvvv
+		bitstream_skip_bits(b, 2);
 		hori = 1;
 		do {
 			hori++;
 		} while (bitstream_read_bit(b) == 1);
-		vert = (int) (bitstream_read_bits(b, 4) - 8);
+		vert = (int)bitstream_read_bits(b, 4) - 8;
 	}
 	*x = *x - (hori * 4);
 	*y = *y + vert;
@@ -113,20 +228,11 @@ static void decode_rle_pos(struct bitstream *b, int *x, int *y)
 
 static uint16_t decode_rle_length(struct bitstream *b)
 {
-	uint16_t length = 0;
-	if (bitstream_read_bit(b) == 0) {
-		length = bitstream_read_bit(b) + 2;
-	} else if (bitstream_read_bit(b) == 0) {
-		length = bitstream_read_bits(b, 2) + 4;
-	} else if (bitstream_read_bit(b) == 0) {
-		length = bitstream_read_bits(b, 3) + 8;
-	} else {
-		length = bitstream_read_bits(b, 6) + 16;
-		if (length >= 79) {
-			length = bitstream_read_bits(b, 10) + 79;
-		}
-	}
-	return length;
+	struct rle_length_code c = rle_length_table[bitstream_peek_bits(b, RLE_LENGTH_BITS)];
+	bitstream_skip_bits(b, c.len);
+	if (c.length == RLE_LENGTH_ESCAPE)
+		return bitstream_read_bits(b, 10) + RLE_LENGTH_ESCAPE;
+	return c.length;
 }
 
 static void decode(struct bitstream *b, unsigned dst_x, uint8_t table[17][16], struct cg *cg)
@@ -138,18 +244,18 @@ static void decode(struct bitstream *b, unsigned dst_x, uint8_t table[17][16], s
 		switch (bitstream_read_bit(b)) {
 		case DECODE_PIXEL:
 			for (unsigned x = 0; x < 4; x++) {
-				uint8_t color = table[table_index][0];
-				int color_index = 0;
-
-				while (bitstream_read_bit(b) == 1) {
-					color_index++;
-					table[table_index][0] = table[table_index][color_index];
-					table[table_index][color_index] = color;
-					color = table[table_index][0];
+				// the color is coded as its index in a move-to-front
+				// list, in unary
+				uint8_t *colors = table[table_index];
+				unsigned color_index = bitstream_read_ones(b);
+				if (color_index) {
+					uint8_t color = colors[color_index];
+					memmove(colors + 1, colors, color_index);
+					colors[0] = color;
 				}
 
-				table_index = color;
-				cg_write_px(cg, dst_x + x, dst_y, color);
+				table_index = colors[0];
+				cg_write_px(cg, dst_x + x, dst_y, colors[0]);
 			}
 			dst_y++;
 			break;
@@ -212,16 +318,17 @@ struct cg *gp4_decode(uint8_t *data, size_t size)
 	struct bitstream b = {
 		.data = data,
 		.size = size,
-		.byte_index = 40,
-		.bit_index = 7,
-		.warned = false
+		.pos = 40,
 	};
 
 	// decode pixels
+	pthread_once(&rle_tables_once, rle_tables_init);
 	unsigned dst_x = 0;
 	for (unsigned x = 0; x < (cg->metrics.w / 4); x++, dst_x += 4) {
 		decode(&b, dst_x, table, cg);
 	}
+	if (bitstream_overrun(&b))
+		WARNING("Attempted to read beyond end of file");
 
 	return cg;
 }
@@ -19,8 +19,8 @@
 
 #include "nulib.h"
 #include "nulib/little_endian.h"
-#include "nulib/lzss.h"
 #include "ai5/cg.h"
+#include "ai5/lzss.h"
 
 struct cg *gp8_decode(uint8_t *data, size_t size)
 {
@@ -35,27 +35,43 @@ struct cg *gp8_decode(uint8_t *data, size_t size)
 	memcpy(cg->palette, data + 8, 256 * 4);
 
 	size_t pos = 8 + 256 * 4;
-	size_t px_size;
-	uint8_t *px = lzss_decompress(data + pos, size - pos, &px_size);
-	if (px_size != cg->metrics.w * cg->metrics.h) {
-		WARNING("Unexpected size for GP8 pixel data (expected %u; got %u)",
-				(unsigned)cg->metrics.w * cg->metrics.h,
+	size_t px_size = cg->metrics.w * cg->metrics.h;
+	size_t px_len;
+	cg->pixels = xmalloc(px_size ? px_size : 1);
+	switch (ai5_lzss_decompress_into(data + pos, size - pos, cg->pixels, px_size, &px_len)) {
+	case AI5_LZSS_OK:
+		break;
+	case AI5_LZSS_OVERRUN:
+		// extra data is ignored
+		WARNING("Unexpected size for GP8 pixel data (expected %u; got more)",
 				(unsigned)px_size);
-		if (px_size < cg->metrics.w * cg->metrics.h) {
-			free(cg->palette);
-			free(cg->pixels);
-			free(cg);
-			return NULL;
+		break;
+	case AI5_LZSS_TRUNCATED:
+		// a dangling reference after a complete image is harmless
+		if (px_len == px_size) {
+			WARNING("Truncated GP8 pixel data");
+			break;
 		}
+		// fallthrough
+	case AI5_LZSS_UNDERRUN:
+		WARNING("Unexpected size for GP8 pixel data (expected %u; got %u)",
+				(unsigned)px_size, (unsigned)px_len);
+		free(cg->palette);
+		free(cg->pixels);
+		free(cg);
+		return NULL;
 	}
 
-	cg->pixels = xmalloc(cg->metrics.w * cg->metrics.h);
-	for (int i = 0; i < cg->metrics.h; i++) {
-		uint8_t *dst = cg->pixels + cg->metrics.w * i;
-		uint8_t *src = px + cg->metrics.w * (cg->metrics.h - (i + 1));
-		memcpy(dst, src, cg->metrics.w);
+	// rows are stored bottom-up
+	uint8_t *tmp = xmalloc(cg->metrics.w ? cg->metrics.w : 1);
+	for (int i = 0; i < cg->metrics.h / 2; i++) {
+		uint8_t *top = cg->pixels + cg->metrics.w * i;
+		uint8_t *bot = cg->pixels + cg->metrics.w * (cg->metrics.h - (i + 1));
+		memcpy(tmp, top, cg->metrics.w);
+		memcpy(top, bot, cg->metrics.w);
+		memcpy(bot, tmp, cg->metrics.w);
 	}
-	free(px);
+	free(tmp);
 
 	return cg;
 }
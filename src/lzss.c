@@ -0,0 +1,669 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * LZSS decompression (the Okumura variant used by AI5 games).
+ *
+ * The 4 KiB ring buffer of the reference decoder starts zero-filled at
+ * position N-F, so when the whole output is in one buffer the ring is just
+ * the last N bytes of output and a reference can be resolved to a distance
+ * back from the current output position. Positions before the start of the
+ * output read as zero.
+ *
+ * The bulk of the data is decoded a whole flag byte at a time, with matches
+ * copied by fixed-size moves that may write past the end of the match (the
+ * bytes past the end are overwritten by what follows). This is only done while
+ * there is enough input and output space left for a full group of 8 tokens;
+ * the remainder is decoded byte by byte.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "nulib.h"
+#include "ai5/lzss.h"
+#include "thread_pool.h"
+
+#define LZSS_N 4096
+#define LZSS_F 18
+#define LZSS_THRESHOLD 2
+
+// a flag byte followed by 8 references, plus the overread of a literal run
+#define FAST_IN_MARGIN (1 + 8 * 2 + 8)
+// 8 maximum-length matches, plus the overshoot of the last copy (this is
+// also AI5_LZSS_DECODE_SLACK)
+#define FAST_OUT_MARGIN (8 * LZSS_F + 32)
+// smallest amount of output decoded at a time by `ai5_lzss_decompress`
+#define INITIAL_OUT_MIN 4096
+
+static inline size_t match_dist(size_t out_pos, unsigned pos)
+{
+	// a distance of 0 wraps around the whole ring
+	unsigned r = (LZSS_N - LZSS_F + out_pos) & (LZSS_N - 1);
+	unsigned dist = (r - pos) & (LZSS_N - 1);
+	return dist ? dist : LZSS_N;
+}
+
+/*
+ * Copy a match whose source lies entirely within the output. Writes up to 32
+ * bytes, regardless of the length of the match.
+ */
+static inline void copy_match(uint8_t *dst, size_t dist, unsigned len)
+{
+	const uint8_t *src = dst - dist;
+	if (dist >= 16) {
+		memcpy(dst, src, 16);
+		memcpy(dst + 16, src + 16, 16);
+	} else if (dist >= 8) {
+		memcpy(dst, src, 8);
+		memcpy(dst + 8, src + 8, 8);
+		memcpy(dst + 16, src + 16, 8);
+	} else if (dist == 1) {
+		memset(dst, src[0], 16);
+		if (len > 16)
+			memset(dst + 16, src[0], 2);
+	} else {
+		// the match repeats the last `dist` bytes: build 8 bytes of the
+		// pattern and store it at multiples of `dist`
+		uint8_t pat[8];
+		for (unsigned i = 0; i < 8; i++) {
+			pat[i] = i < dist ? src[i] : pat[i - dist];
+		}
+		unsigned step = 8 - 8 % dist;
+		for (unsigned i = 0; i < len; i += step) {
+			memcpy(dst + i, pat, 8);
+		}
+	}
+}
+
+/*
+ * Copy a match byte by byte, reading zeros before the start of the output.
+ * `base` is the position of `out` within the whole output.
+ */
+static inline void copy_match_slow(uint8_t *out, size_t out_pos, size_t dist, unsigned len,
+		size_t base)
+{
+	for (unsigned i = 0; i < len; i++, out_pos++) {
+		out[out_pos] = base + out_pos >= dist ? out[out_pos - dist] : 0;
+	}
+}
+
+/*
+ * Decode a group of 8 tokens (a flag byte and what follows it). There must be
+ * FAST_IN_MARGIN bytes of input and FAST_OUT_MARGIN bytes of output space, and
+ * the LZSS_N bytes before `out + out_pos` (or all of the output, if there are
+ * fewer) must hold the preceding output.
+ */
+static inline void decode_group(const uint8_t *in, size_t *_in_pos, uint8_t *out,
+		size_t *_out_pos, size_t base)
+{
+	size_t in_pos = *_in_pos;
+	size_t out_pos = *_out_pos;
+	unsigned flags = in[in_pos++];
+	unsigned left = 8;
+	for (;;) {
+		// copy the run of literals at once (the bits above the
+		// remaining flags are clear, so the run stops there)
+		unsigned run = __builtin_ctz(~flags);
+		memcpy(out + out_pos, in + in_pos, 8);
+		in_pos += run;
+		out_pos += run;
+		if (!(left -= run))
+			break;
+
+		unsigned lo = in[in_pos];
+		unsigned hi = in[in_pos+1];
+		in_pos += 2;
+		unsigned len = (hi & 0x0f) + LZSS_THRESHOLD + 1;
+		size_t dist = match_dist(base + out_pos, lo | ((hi & 0xf0) << 4));
+		if (dist <= out_pos)
+			copy_match(out + out_pos, dist, len);
+		else
+			copy_match_slow(out, out_pos, dist, len, base);
+		out_pos += len;
+		flags >>= run + 1;
+		if (!--left)
+			break;
+	}
+	*_in_pos = in_pos;
+	*_out_pos = out_pos;
+}
+
+enum ai5_lzss_status ai5_lzss_decompress_into(const uint8_t *in, size_t in_size,
+		uint8_t *out, size_t out_size, size_t *out_len)
+{
+	enum ai5_lzss_status status = AI5_LZSS_OK;
+	size_t in_pos = 0;
+	size_t out_pos = 0;
+
+	while (in_size - in_pos >= FAST_IN_MARGIN && out_size - out_pos >= FAST_OUT_MARGIN) {
+		decode_group(in, &in_pos, out, &out_pos, 0);
+	}
+
+	unsigned flags = 0;
+	for (;;) {
+		if (((flags >>= 1) & 0x100) == 0) {
+			if (in_pos >= in_size)
+				break;
+			flags = in[in_pos++] | 0xff00;
+		}
+		if (flags & 1) {
+			if (in_pos >= in_size)
+				break;
+			if (out_pos >= out_size) {
+				status = AI5_LZSS_OVERRUN;
+				break;
+			}
+			out[out_pos++] = in[in_pos++];
+		} else {
+			if (in_pos + 1 >= in_size) {
+				// the encoder never splits a reference
+				if (in_pos + 1 == in_size)
+					status = AI5_LZSS_TRUNCATED;
+				break;
+			}
+			unsigned pos = in[in_pos] | ((in[in_pos+1] & 0xf0) << 4);
+			unsigned len = (in[in_pos+1] & 0x0f) + LZSS_THRESHOLD + 1;
+			in_pos += 2;
+			size_t dist = match_dist(out_pos, pos);
+			if (len > out_size - out_pos) {
+				len = out_size - out_pos;
+				status = AI5_LZSS_OVERRUN;
+			}
+			copy_match_slow(out, out_pos, dist, len, 0);
+			out_pos += len;
+			if (status == AI5_LZSS_OVERRUN)
+				break;
+		}
+	}
+	if (status == AI5_LZSS_OK && out_pos < out_size)
+		status = AI5_LZSS_UNDERRUN;
+	if (out_len)
+		*out_len = out_pos;
+	return status;
+}
+
+uint8_t *ai5_lzss_decompress(const uint8_t *in, size_t in_size, size_t *out_size)
+{
+	// Start from a typical compression ratio and grow geometrically, rather
+	// than allocating for the worst case (about 8.5 times the input) up front.
+	// The decoder keeps the preceding output in the buffer, so growing it
+	// doesn't restart decoding.
+	struct ai5_lzss_decoder d;
+	ai5_lzss_decoder_init(&d, in, in_size);
+	size_t cap = in_size * 4 + INITIAL_OUT_MIN + AI5_LZSS_DECODE_SLACK;
+	uint8_t *out = xmalloc(cap);
+	size_t len = 0;
+	for (;;) {
+		if (cap - len < INITIAL_OUT_MIN + AI5_LZSS_DECODE_SLACK) {
+			cap *= 2;
+			out = xrealloc(out, cap);
+		}
+		size_t n = ai5_lzss_decode(&d, out, len, cap - len - AI5_LZSS_DECODE_SLACK);
+		if (!n)
+			break;
+		len += n;
+	}
+	// like nulib, ignore a reference cut short at the end of the input
+	*out_size = len;
+	return xrealloc(out, len ? len : 1);
+}
+
+void ai5_lzss_decoder_init(struct ai5_lzss_decoder *d, const uint8_t *in, size_t in_size)
+{
+	d->in = in;
+	d->in_size = in_size;
+	d->in_pos = 0;
+	d->out_pos = 0;
+	d->end = false;
+	d->truncated = false;
+}
+
+/*
+ * Decode a group of 8 tokens near the end of the input. Returns false (and
+ * the group is incomplete) if the input ends.
+ */
+static bool decode_group_tail(struct ai5_lzss_decoder *d, uint8_t *out, size_t *_out_pos,
+		size_t base)
+{
+	size_t out_pos = *_out_pos;
+	bool r = false;
+	if (d->in_pos >= d->in_size)
+		goto end;
+	unsigned flags = d->in[d->in_pos++];
+	for (int i = 0; i < 8; i++, flags >>= 1) {
+		if (flags & 1) {
+			if (d->in_pos >= d->in_size)
+				goto end;
+			out[out_pos++] = d->in[d->in_pos++];
+		} else {
+			if (d->in_pos + 1 >= d->in_size) {
+				d->truncated = d->in_pos + 1 == d->in_size;
+				goto end;
+			}
+			unsigned pos = d->in[d->in_pos] | ((d->in[d->in_pos+1] & 0xf0) << 4);
+			unsigned len = (d->in[d->in_pos+1] & 0x0f) + LZSS_THRESHOLD + 1;
+			d->in_pos += 2;
+			copy_match_slow(out, out_pos, match_dist(base + out_pos, pos), len, base);
+			out_pos += len;
+		}
+	}
+	r = true;
+end:
+	*_out_pos = out_pos;
+	return r;
+}
+
+size_t ai5_lzss_decode(struct ai5_lzss_decoder *d, uint8_t *buf, size_t pos, size_t min)
+{
+	// position of `buf` within the output
+	size_t base = d->out_pos - pos;
+	size_t start = pos;
+	while (pos - start < min && !d->end) {
+		if (d->in_size - d->in_pos >= FAST_IN_MARGIN)
+			decode_group(d->in, &d->in_pos, buf, &pos, base);
+		else if (!decode_group_tail(d, buf, &pos, base))
+			d->end = true;
+	}
+	d->out_pos += pos - start;
+	return pos - start;
+}
+
+/*
+ * LZSS compression.
+ *
+ * Matches are found with hash chains over 3-byte prefixes. Only the last
+ * N-F bytes are searched (as in the reference encoder, which keeps the
+ * lookahead in the ring), and the zeros before the start of the data are
+ * never referenced, so the output is valid for any ring-buffer decoder.
+ */
+
+#define HASH_BITS 15
+#define HASH_SIZE (1 << HASH_BITS)
+#define MAX_DIST (LZSS_N - LZSS_F)
+#define NO_POS UINT32_MAX
+
+// input size per job for parallel compression
+#define MT_CHUNK_SIZE (256 * 1024)
+
+// costs in bits (every token also takes a bit in a flag byte)
+#define LITERAL_COST 9
+#define MATCH_COST 17
+
+static const struct lzss_level {
+	unsigned chain; // maximum number of chain links followed per search
+	bool lazy;      // defer a match if the next position has a longer one
+	bool optimal;   // choose tokens by cost over the whole input
+} lzss_levels[] = {
+	[1] = { 4,      false, false },
+	[2] = { 8,      false, false },
+	[3] = { 16,     true,  false },
+	[4] = { 32,     true,  false },
+	[5] = { 64,     true,  false },
+	[6] = { 128,    true,  false },
+	[7] = { 512,    true,  false },
+	[8] = { LZSS_N, true,  false },
+	[9] = { LZSS_N, false, true  },
+};
+
+struct lzss_matcher {
+	const uint8_t *in;
+	size_t end;     // end of the data being compressed
+	size_t next;    // next position to insert
+	unsigned chain;
+	uint32_t head[HASH_SIZE];
+	uint32_t prev[LZSS_N];
+};
+
+static inline uint32_t lzss_hash(const uint8_t *p)
+{
+	uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/*
+ * Prepare to compress in[start..end). The MAX_DIST bytes before `start` are
+ * used as history.
+ */
+static void matcher_init(struct lzss_matcher *m, const uint8_t *in, size_t start,
+		size_t end, unsigned chain)
+{
+	m->in = in;
+	m->end = end;
+	m->next = start > MAX_DIST ? start - MAX_DIST : 0;
+	m->chain = chain;
+	memset(m->head, 0xff, sizeof(m->head));
+}
+
+/*
+ * Insert positions up to (not including) `pos` into the hash chains.
+ */
+static void matcher_insert(struct lzss_matcher *m, size_t pos)
+{
+	// the hash covers 3 bytes
+	size_t end = m->end < 2 ? 0 : m->end - 2;
+	if (pos > end)
+		pos = end;
+	for (; m->next < pos; m->next++) {
+		uint32_t h = lzss_hash(m->in + m->next);
+		m->prev[m->next & (LZSS_N - 1)] = m->head[h];
+		m->head[h] = m->next;
+	}
+}
+
+/*
+ * Find the longest match for the data at `pos` (which must have been
+ * inserted). Returns its length, or 0 if there is no match of at least
+ * THRESHOLD+1 bytes.
+ */
+static unsigned matcher_find(struct lzss_matcher *m, size_t pos, size_t *dist_out)
+{
+	size_t max_len = m->end - pos;
+	if (max_len > LZSS_F)
+		max_len = LZSS_F;
+	if (max_len <= LZSS_THRESHOLD)
+		return 0;
+
+	const uint8_t *p = m->in + pos;
+	unsigned best = LZSS_THRESHOLD;
+	uint32_t cand = m->prev[pos & (LZSS_N - 1)];
+	for (unsigned n = m->chain; n && cand != NO_POS && pos - cand <= MAX_DIST; n--) {
+		const uint8_t *q = m->in + cand;
+		// check the byte that would extend the best match first
+		if (q[best] == p[best]) {
+			unsigned len = 0;
+			while (len < max_len && q[len] == p[len])
+				len++;
+			if (len > best) {
+				best = len;
+				*dist_out = pos - cand;
+				if (len == max_len)
+					break;
+			}
+		}
+		cand = m->prev[cand & (LZSS_N - 1)];
+	}
+	return best > LZSS_THRESHOLD ? best : 0;
+}
+
+struct lzss_writer {
+	uint8_t *out;
+	size_t pos;
+	size_t flag_pos;
+	unsigned bit;
+	size_t tokens;
+};
+
+static inline void writer_token(struct lzss_writer *w)
+{
+	if (w->bit == 8) {
+		w->flag_pos = w->pos++;
+		w->out[w->flag_pos] = 0;
+		w->bit = 0;
+	}
+	w->tokens++;
+}
+
+static inline void writer_literal(struct lzss_writer *w, uint8_t c)
+{
+	writer_token(w);
+	w->out[w->flag_pos] |= 1 << w->bit++;
+	w->out[w->pos++] = c;
+}
+
+static inline void writer_match(struct lzss_writer *w, size_t in_pos, size_t dist,
+		unsigned len)
+{
+	writer_token(w);
+	w->bit++;
+	unsigned pos = (LZSS_N - LZSS_F + in_pos - dist) & (LZSS_N - 1);
+	w->out[w->pos++] = pos & 0xff;
+	w->out[w->pos++] = ((pos >> 4) & 0xf0) | (len - LZSS_THRESHOLD - 1);
+}
+
+static void compress_greedy(struct lzss_matcher *m, struct lzss_writer *w, size_t start,
+		bool lazy)
+{
+	size_t pos = start;
+	while (pos < m->end) {
+		size_t dist;
+		matcher_insert(m, pos + 1);
+		unsigned len = matcher_find(m, pos, &dist);
+		if (len && lazy && len < LZSS_F) {
+			size_t next_dist;
+			matcher_insert(m, pos + 2);
+			if (matcher_find(m, pos + 1, &next_dist) > len)
+				len = 0;
+		}
+		if (!len) {
+			writer_literal(w, m->in[pos++]);
+			continue;
+		}
+		writer_match(w, pos, dist, len);
+		pos += len;
+	}
+}
+
+static void compress_optimal(struct lzss_matcher *m, struct lzss_writer *w, size_t start)
+{
+	// the longest match at each position (any shorter length can be taken
+	// from the same match, at the same cost)
+	size_t n = m->end - start;
+	uint8_t *len = xmalloc(n + 1);
+	uint16_t *dist = xmalloc((n + 1) * sizeof(uint16_t));
+	for (size_t i = 0; i < n; i++) {
+		size_t d = 0;
+		matcher_insert(m, start + i + 1);
+		len[i] = matcher_find(m, start + i, &d);
+		dist[i] = d;
+	}
+
+	// cost[i] is the minimum cost of encoding the data from `start + i`;
+	// work backwards, reusing `len` for the chosen token length (0 = literal)
+	uint32_t *cost = xmalloc((n + 1) * sizeof(uint32_t));
+	cost[n] = 0;
+	for (size_t i = n; i-- > 0;) {
+		uint32_t best = cost[i + 1] + LITERAL_COST;
+		unsigned choice = 0;
+		for (unsigned l = LZSS_THRESHOLD + 1; l <= len[i]; l++) {
+			uint32_t c = cost[i + l] + MATCH_COST;
+			if (c < best) {
+				best = c;
+				choice = l;
+			}
+		}
+		cost[i] = best;
+		len[i] = choice;
+	}
+
+	for (size_t i = 0; i < n;) {
+		if (!len[i]) {
+			writer_literal(w, m->in[start + i++]);
+			continue;
+		}
+		writer_match(w, start + i, dist[i], len[i]);
+		i += len[i];
+	}
+	free(cost);
+	free(dist);
+	free(len);
+}
+
+static const struct lzss_level *get_level(int level)
+{
+	if (level <= 0)
+		level = AI5_LZSS_DEFAULT_LEVEL;
+	if (level > AI5_LZSS_MAX_LEVEL)
+		level = AI5_LZSS_MAX_LEVEL;
+	return &lzss_levels[level];
+}
+
+/*
+ * Compress in[start..end) as a stream of its own (with matches reaching back
+ * before `start`).
+ */
+static void compress_range(const uint8_t *in, size_t start, size_t end,
+		const struct lzss_level *l, struct lzss_writer *w)
+{
+	// every 8 literals take 9 bytes
+	size_t size = end - start;
+	*w = (struct lzss_writer) {
+		.out = xmalloc(size + size / 8 + 1),
+		.bit = 8,
+	};
+
+	struct lzss_matcher *m = xmalloc(sizeof(struct lzss_matcher));
+	matcher_init(m, in, start, end, l->chain);
+	if (l->optimal)
+		compress_optimal(m, w, start);
+	else
+		compress_greedy(m, w, start, l->lazy);
+	free(m);
+}
+
+uint8_t *ai5_lzss_compress(const uint8_t *in, size_t in_size, size_t *out_size, int level)
+{
+	struct lzss_writer w;
+	compress_range(in, 0, in_size, get_level(level), &w);
+	*out_size = w.pos;
+	return w.out;
+}
+
+/*
+ * Parallel compression.
+ *
+ * The input is split into chunks which are compressed independently, each
+ * with the preceding MAX_DIST bytes as history. Every chunk's stream starts
+ * with a new flag byte, so the streams can't simply be concatenated: once the
+ * token counts are known, each chunk is repacked at its final offset with its
+ * flag bits shifted to the global token alignment. Flag bits for the tokens
+ * that complete the last group of the previous chunk are merged afterwards.
+ */
+
+struct compress_chunk {
+	const uint8_t *in;
+	size_t start;
+	size_t end;
+	const struct lzss_level *level;
+	struct lzss_writer w;
+	// final placement
+	uint8_t *out;
+	size_t out_pos;
+	size_t first_token;
+	size_t last_flag;   // position of the last flag byte written (if any)
+	bool has_flag;
+	uint8_t carry;      // flag bits for the previous chunk's last group
+};
+
+static void compress_chunk_run(void *_c)
+{
+	struct compress_chunk *c = _c;
+	compress_range(c->in, c->start, c->end, c->level, &c->w);
+}
+
+static void repack_chunk_run(void *_c)
+{
+	struct compress_chunk *c = _c;
+	const uint8_t *src = c->w.out;
+	uint8_t *out = c->out;
+	c->carry = 0;
+	c->has_flag = false;
+
+	if (c->first_token % 8 == 0) {
+		// already aligned
+		memcpy(out + c->out_pos, src, c->w.pos);
+		c->last_flag = c->out_pos + c->w.flag_pos;
+		c->has_flag = c->w.tokens > 0;
+		return;
+	}
+
+	size_t src_pos = 0;
+	size_t out_pos = c->out_pos;
+	unsigned flags = 0;
+	for (size_t t = 0; t < c->w.tokens; t++) {
+		if (t % 8 == 0)
+			flags = src[src_pos++];
+		unsigned bit = (c->first_token + t) % 8;
+		if (bit == 0) {
+			c->last_flag = out_pos++;
+			c->has_flag = true;
+			out[c->last_flag] = 0;
+		}
+		if (flags & 1) {
+			if (c->has_flag)
+				out[c->last_flag] |= 1 << bit;
+			else
+				c->carry |= 1 << bit;
+			out[out_pos++] = src[src_pos++];
+		} else {
+			out[out_pos++] = src[src_pos++];
+			out[out_pos++] = src[src_pos++];
+		}
+		flags >>= 1;
+	}
+}
+
+uint8_t *ai5_lzss_compress_mt(const uint8_t *in, size_t in_size, size_t *out_size,
+		int level, unsigned nr_threads)
+{
+	if (!nr_threads)
+		nr_threads = thread_pool_nr_cpus();
+	if (nr_threads < 2 || in_size < 2 * MT_CHUNK_SIZE)
+		return ai5_lzss_compress(in, in_size, out_size, level);
+
+	unsigned nr_chunks = (in_size + MT_CHUNK_SIZE - 1) / MT_CHUNK_SIZE;
+	struct compress_chunk *chunks = xcalloc(nr_chunks, sizeof(struct compress_chunk));
+	struct thread_pool *pool = thread_pool_new(nr_threads);
+	for (unsigned i = 0; i < nr_chunks; i++) {
+		chunks[i].in = in;
+		chunks[i].start = (size_t)i * MT_CHUNK_SIZE;
+		chunks[i].end = i + 1 < nr_chunks ? chunks[i].start + MT_CHUNK_SIZE : in_size;
+		chunks[i].level = get_level(level);
+		thread_pool_submit(pool, compress_chunk_run, &chunks[i]);
+	}
+	thread_pool_wait(pool);
+
+	// place the chunks: the output up to a token is the payload of all
+	// preceding tokens plus a flag byte for every group started before it
+	size_t tokens = 0;
+	size_t payload = 0;
+	for (unsigned i = 0; i < nr_chunks; i++) {
+		struct compress_chunk *c = &chunks[i];
+		c->first_token = tokens;
+		c->out_pos = payload + (tokens + 7) / 8;
+		tokens += c->w.tokens;
+		payload += c->w.pos - (c->w.tokens + 7) / 8;
+	}
+	*out_size = payload + (tokens + 7) / 8;
+	uint8_t *out = xmalloc(*out_size ? *out_size : 1);
+
+	for (unsigned i = 0; i < nr_chunks; i++) {
+		chunks[i].out = out;
+		thread_pool_submit(pool, repack_chunk_run, &chunks[i]);
+	}
+	thread_pool_free(pool);
+
+	size_t last_flag = 0;
+	for (unsigned i = 0; i < nr_chunks; i++) {
+		if (chunks[i].carry)
+			out[last_flag] |= chunks[i].carry;
+		if (chunks[i].has_flag)
+			last_flag = chunks[i].last_flag;
+		free(chunks[i].w.out);
+	}
+	free(chunks);
+	return out;
+}
@@ -0,0 +1,146 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "nulib.h"
+#include "thread_pool.h"
+
+struct thread_pool_job {
+	void (*fn)(void*);
+	void *arg;
+	struct thread_pool_job *next;
+};
+
+struct thread_pool {
+	pthread_mutex_t lock;
+	// signalled when a job is queued, or when the pool is shutting down
+	pthread_cond_t work;
+	// signalled when the last pending job completes
+	pthread_cond_t idle;
+	struct thread_pool_job *head;
+	struct thread_pool_job *tail;
+	unsigned pending; // queued + running jobs
+	bool shutdown;
+	unsigned nr_threads;
+	pthread_t threads[];
+};
+
+unsigned thread_pool_nr_cpus(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#endif
+}
+
+static void *thread_pool_worker(void *_pool)
+{
+	struct thread_pool *pool = _pool;
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		while (!pool->head && !pool->shutdown)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (!pool->head)
+			break;
+
+		struct thread_pool_job *job = pool->head;
+		pool->head = job->next;
+		if (!pool->head)
+			pool->tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		job->fn(job->arg);
+		free(job);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0)
+			pthread_cond_broadcast(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct thread_pool *thread_pool_new(unsigned nr_threads)
+{
+	if (!nr_threads)
+		nr_threads = thread_pool_nr_cpus();
+
+	struct thread_pool *pool = xcalloc(1, sizeof(struct thread_pool)
+			+ nr_threads * sizeof(pthread_t));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	for (unsigned i = 0; i < nr_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool))
+			ERROR("pthread_create failed");
+	}
+	pool->nr_threads = nr_threads;
+	return pool;
+}
+
+void thread_pool_submit(struct thread_pool *pool, void (*fn)(void*), void *arg)
+{
+	struct thread_pool_job *job = xmalloc(sizeof(struct thread_pool_job));
+	job->fn = fn;
+	job->arg = arg;
+	job->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail)
+		pool->tail->next = job;
+	else
+		pool->head = job;
+	pool->tail = job;
+	pool->pending++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_wait(struct thread_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_free(struct thread_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (unsigned i = 0; i < pool->nr_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->idle);
+	free(pool);
+}
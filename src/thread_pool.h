@@ -0,0 +1,48 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef AI5_THREAD_POOL_H
+#define AI5_THREAD_POOL_H
+
+struct thread_pool;
+
+/*
+ * Get the number of online CPUs.
+ */
+unsigned thread_pool_nr_cpus(void);
+
+/*
+ * Create a thread pool with `nr_threads` worker threads. If `nr_threads` is
+ * zero, one thread per CPU is created.
+ */
+struct thread_pool *thread_pool_new(unsigned nr_threads);
+
+/*
+ * Queue a job to be run on a worker thread.
+ */
+void thread_pool_submit(struct thread_pool *pool, void (*fn)(void*), void *arg);
+
+/*
+ * Wait for all queued jobs to complete.
+ */
+void thread_pool_wait(struct thread_pool *pool);
+
+/*
+ * Wait for all queued jobs to complete and destroy the pool.
+ */
+void thread_pool_free(struct thread_pool *pool);
+
+#endif // AI5_THREAD_POOL_H
@@ -0,0 +1,98 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Pixel conversion throughput for each instruction set level, in megapixels
+ * per second, converting a 1280x720 image a row at a time.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nulib.h"
+#include "cg/convert.h"
+#include "test.h"
+
+#define W 1280
+#define H 720
+// minimum time spent on each measurement
+#define BENCH_NS 200000000ull
+
+typedef void (*row_fn)(const uint8_t *px, uint8_t *out, unsigned w);
+
+static const struct {
+	const char *name;
+	size_t offset;
+	unsigned in_bpp;
+	unsigned out_bpp;
+} row_ops[] = {
+	{ "bgr555_to_rgba", offsetof(struct cg_convert_ops, bgr555_to_rgba), 2, 4 },
+	{ "bgr_to_rgba",    offsetof(struct cg_convert_ops, bgr_to_rgba),    3, 4 },
+	{ "bgra_to_rgba",   offsetof(struct cg_convert_ops, bgra_to_rgba),   4, 4 },
+	{ "rgba_to_bgr555", offsetof(struct cg_convert_ops, rgba_to_bgr555), 4, 2 },
+	{ "rgba_to_bgr",    offsetof(struct cg_convert_ops, rgba_to_bgr),    4, 3 },
+};
+
+static const struct {
+	const char *name;
+	unsigned isa;
+} levels[] = {
+	{ "scalar", 0 },
+	{ "sse2",   CG_CONVERT_SSE2 },
+	{ "ssse3",  CG_CONVERT_SSE2 | CG_CONVERT_SSSE3 },
+	{ "avx2",   CG_CONVERT_ALL },
+};
+
+int main(void)
+{
+	uint8_t *in = xmalloc(W * H * 4);
+	uint8_t *out = xmalloc(W * H * 4);
+	for (size_t i = 0; i < W * H * 4; i++) {
+		in[i] = test_rand();
+	}
+
+	printf("%-16s", "Mpx/s");
+	for (unsigned l = 0; l < ARRAY_SIZE(levels); l++) {
+		printf(" %8s", levels[l].name);
+	}
+	printf("\n");
+
+	for (unsigned op = 0; op < ARRAY_SIZE(row_ops); op++) {
+		printf("%-16s", row_ops[op].name);
+		for (unsigned l = 0; l < ARRAY_SIZE(levels); l++) {
+			struct cg_convert_ops ops;
+			cg_convert_select(&ops, levels[l].isa);
+			row_fn fn = *(row_fn*)((uint8_t*)&ops + row_ops[op].offset);
+			uint64_t start = test_time_ns(), elapsed;
+			uint64_t images = 0;
+			do {
+				for (unsigned row = 0; row < H; row++) {
+					fn(in + row * W * row_ops[op].in_bpp,
+							out + row * W * row_ops[op].out_bpp, W);
+				}
+				images++;
+			} while ((elapsed = test_time_ns() - start) < BENCH_NS);
+			printf(" %8.0f", (double)W * H * images * 1000 / elapsed);
+		}
+		printf("\n");
+	}
+
+	free(in);
+	free(out);
+	return 0;
+}
@@ -0,0 +1,99 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * LZSS decompression throughput of nulib's `lzss_decompress` and
+ * `ai5_lzss_decompress`, in GB/s of output, on inputs of the sizes found in
+ * game archives.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nulib.h"
+#include "nulib/lzss.h"
+#include "ai5/lzss.h"
+#include "test.h"
+
+// minimum time spent on each measurement
+#define BENCH_NS 200000000ull
+
+static uint8_t *image_data(unsigned w, unsigned h, unsigned bpp, size_t *size_out)
+{
+	size_t size = (size_t)w * h * (bpp / 8);
+	uint8_t *data = xmalloc(size);
+	for (size_t i = 0; i < size; i++) {
+		size_t px = i / (bpp / 8);
+		unsigned x = px % w, y = px / w;
+		// smooth gradients with a little noise, like a typical CG
+		data[i] = (x / 4 + y / 3 + (i % (bpp / 8)) * 40) + (test_rand() % 16 == 0);
+	}
+	*size_out = size;
+	return data;
+}
+
+static double bench(uint8_t *(*decompress)(uint8_t*, size_t, size_t*), uint8_t *in,
+		size_t in_size, size_t out_size)
+{
+	uint64_t start = test_time_ns(), elapsed;
+	uint64_t iterations = 0;
+	do {
+		size_t size;
+		free(decompress(in, in_size, &size));
+		iterations++;
+	} while ((elapsed = test_time_ns() - start) < BENCH_NS);
+	return (double)out_size * iterations / elapsed;
+}
+
+static uint8_t *ai5_decompress(uint8_t *in, size_t in_size, size_t *out_size)
+{
+	return ai5_lzss_decompress(in, in_size, out_size);
+}
+
+static uint8_t *nulib_decompress(uint8_t *in, size_t in_size, size_t *out_size)
+{
+	return lzss_decompress(in, in_size, out_size);
+}
+
+int main(void)
+{
+	struct {
+		const char *name;
+		uint8_t *data;
+		size_t size;
+	} inputs[4];
+	inputs[0].name = "640x480x24 CG";
+	inputs[0].data = image_data(640, 480, 24, &inputs[0].size);
+	inputs[1].name = "1920x1080x32 CG";
+	inputs[1].data = image_data(1920, 1080, 32, &inputs[1].size);
+	inputs[2].name = "64 KiB MES";
+	inputs[2].data = test_text(64 * 1024, &inputs[2].size);
+	inputs[3].name = "1 MiB MES";
+	inputs[3].data = test_text(1024 * 1024, &inputs[3].size);
+
+	printf("%-16s %16s %20s\n", "input (GB/s)", "lzss_decompress", "ai5_lzss_decompress");
+	for (unsigned i = 0; i < ARRAY_SIZE(inputs); i++) {
+		size_t in_size;
+		uint8_t *in = ai5_lzss_compress(inputs[i].data, inputs[i].size, &in_size, 0);
+		double nulib = bench(nulib_decompress, in, in_size, inputs[i].size);
+		double ai5 = bench(ai5_decompress, in, in_size, inputs[i].size);
+		printf("%-16s %16.2f %20.2f\n", inputs[i].name, nulib, ai5);
+		free(in);
+		free(inputs[i].data);
+	}
+	return 0;
+}
@@ -0,0 +1,247 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * CG decoding tests: G16/G24/G32 and GP8 images are built from random pixel
+ * data and the decoded images are compared against a straightforward
+ * decoding of the same data.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nulib.h"
+#include "nulib/little_endian.h"
+#include "ai5/cg.h"
+#include "ai5/lzss.h"
+#include "test.h"
+
+/*
+ * Build a CG file: an 8-byte header and a palette (if any), followed by the
+ * LZSS-compressed pixel data. `extra` bytes are added to (or, if negative,
+ * removed from) the end of the pixel data.
+ */
+static uint8_t *make_cg(unsigned w, unsigned h, const uint8_t *palette, const uint8_t *px,
+		size_t px_size, int extra, size_t *size_out)
+{
+	size_t raw_size = px_size + (extra > 0 ? extra : 0);
+	uint8_t *raw = xcalloc(1, raw_size + 1);
+	memcpy(raw, px, px_size);
+	if (extra < 0)
+		raw_size = (size_t)-extra > raw_size ? 0 : raw_size + extra;
+
+	size_t zipped_size;
+	uint8_t *zipped = ai5_lzss_compress(raw, raw_size, &zipped_size, 1 + test_rand() % 9);
+	size_t hdr_size = 8 + (palette ? 256 * 4 : 0);
+	uint8_t *data = xmalloc(hdr_size + zipped_size);
+	le_put16(data, 0, 12);
+	le_put16(data, 2, 34);
+	le_put16(data, 4, w);
+	le_put16(data, 6, h);
+	if (palette)
+		memcpy(data + 8, palette, 256 * 4);
+	memcpy(data + hdr_size, zipped, zipped_size);
+	free(zipped);
+	free(raw);
+	*size_out = hdr_size + zipped_size;
+	return data;
+}
+
+/*
+ * Convert a pixel of a Gxx image to RGBA.
+ */
+static void gxx_pixel(const uint8_t *p, unsigned bpp, uint8_t *rgba)
+{
+	if (bpp == 16) {
+		uint16_t c = le_get16(p, 0);
+		rgba[0] = (c & 0x7c00) >> 7;
+		rgba[1] = (c & 0x03e0) >> 2;
+		rgba[2] = (c & 0x001f) << 3;
+		rgba[3] = 0xff;
+	} else {
+		rgba[0] = p[2];
+		rgba[1] = p[1];
+		rgba[2] = p[0];
+		rgba[3] = bpp == 32 ? p[3] : 0xff;
+	}
+}
+
+static void test_gxx(unsigned bpp, enum cg_type type)
+{
+	for (int i = 0; i < 500; i++) {
+		// mostly small images, and some wide enough that a single row
+		// doesn't fit in a decoding batch
+		unsigned w = i % 50 == 0 ? 5000 + test_rand() % 100 : test_rand() % 300;
+		unsigned h = i % 50 == 0 ? 1 + test_rand() % 4 : test_rand() % 40;
+		size_t stride = ((bpp / 8) * w + 3) & ~3;
+		size_t px_size = stride * h;
+		uint8_t *px = xmalloc(px_size + 1);
+		for (size_t j = 0; j < px_size; j++) {
+			// runs of a few colors, so that the data compresses
+			px[j] = j % 7 == 0 ? test_rand() : test_rand() % 4;
+		}
+
+		// well-formed, too short and too long data
+		int extra = i % 10 == 8 ? -1 - (int)(test_rand() % 16) : i % 10 == 9 ? 1 + test_rand() % 16 : 0;
+		bool valid = !extra || (extra < 0 && px_size == 0);
+		size_t size;
+		uint8_t *data = make_cg(w, h, NULL, px, px_size, extra, &size);
+		struct cg *cg = cg_load(data, size, type);
+		TEST_ASSERT(!cg == !valid);
+		if (cg && valid) {
+			TEST_ASSERT(cg->metrics.w == w && cg->metrics.h == h);
+			TEST_ASSERT(cg->metrics.x == 12 && cg->metrics.y == 34);
+			TEST_ASSERT(cg->metrics.bpp == bpp && !cg->palette);
+			// rows are stored bottom-up
+			bool same = true;
+			for (unsigned y = 0; y < h; y++) {
+				for (unsigned x = 0; x < w; x++) {
+					uint8_t rgba[4];
+					gxx_pixel(px + (h - 1 - y) * stride + x * (bpp / 8), bpp, rgba);
+					same = same && !memcmp(cg->pixels + (y * w + x) * 4, rgba, 4);
+				}
+			}
+			TEST_ASSERT(same);
+		}
+		cg_free(cg);
+		free(data);
+		free(px);
+	}
+}
+
+static void test_gxx_write(unsigned bpp, enum cg_type type)
+{
+	for (int i = 0; i < 50; i++) {
+		struct cg cg = {
+			.metrics = { .x = 5, .y = 6, .w = 1 + test_rand() % 300, .h = 1 + test_rand() % 40 },
+		};
+		size_t size = (size_t)cg.metrics.w * cg.metrics.h * 4;
+		cg.pixels = xmalloc(size + 1);
+		for (size_t j = 0; j < size; j++) {
+			cg.pixels[j] = j % 5 == 0 ? test_rand() : test_rand() % 2;
+		}
+
+		FILE *f = tmpfile();
+		TEST_ASSERT(f);
+		TEST_ASSERT(cg_write(&cg, f, type));
+		long file_size = ftell(f);
+		uint8_t *data = xmalloc(file_size);
+		rewind(f);
+		TEST_ASSERT(fread(data, file_size, 1, f) == 1);
+		fclose(f);
+
+		struct cg *out = cg_load(data, file_size, type);
+		TEST_ASSERT(out);
+		if (out) {
+			TEST_ASSERT(out->metrics.w == cg.metrics.w && out->metrics.h == cg.metrics.h);
+			bool same = true;
+			for (size_t j = 0; j < size; j++) {
+				uint8_t expected = cg.pixels[j];
+				if (j % 4 == 3)
+					expected = bpp == 32 ? expected : 0xff;
+				else if (bpp == 16)
+					expected &= 0xf8;
+				same = same && out->pixels[j] == expected;
+			}
+			TEST_ASSERT(same);
+		}
+		cg_free(out);
+		free(data);
+		free(cg.pixels);
+	}
+}
+
+static void test_gp8(void)
+{
+	for (int i = 0; i < 300; i++) {
+		unsigned w = test_rand() % 300;
+		unsigned h = test_rand() % 40;
+		size_t px_size = (size_t)w * h;
+		uint8_t palette[256 * 4];
+		for (unsigned j = 0; j < sizeof(palette); j++) {
+			palette[j] = test_rand();
+		}
+		uint8_t *px = xmalloc(px_size + 1);
+		for (size_t j = 0; j < px_size; j++) {
+			px[j] = j % 3 == 0 ? test_rand() : test_rand() % 8;
+		}
+
+		// extra data is ignored; missing data is an error
+		int extra = i % 10 == 8 ? -1 - (int)(test_rand() % 16) : i % 10 == 9 ? 1 + test_rand() % 16 : 0;
+		bool valid = extra >= 0 || px_size == 0;
+		size_t size;
+		uint8_t *data = make_cg(w, h, palette, px, px_size, extra, &size);
+		struct cg *cg = cg_load(data, size, CG_TYPE_GP8);
+		TEST_ASSERT(!cg == !valid);
+		if (cg) {
+			TEST_ASSERT(cg->metrics.w == w && cg->metrics.h == h);
+			TEST_ASSERT(cg->palette && !memcmp(cg->palette, palette, sizeof(palette)));
+			bool same = true;
+			for (unsigned y = 0; y < h; y++) {
+				same = same && !memcmp(cg->pixels + y * w, px + (h - 1 - y) * w, w);
+			}
+			TEST_ASSERT(same);
+
+			// BGRx palette to RGBA
+			struct cg *rgba = cg_depalettize_copy(cg);
+			TEST_ASSERT(!rgba->palette);
+			same = true;
+			for (size_t j = 0; j < px_size; j++) {
+				const uint8_t *c = palette + cg->pixels[j] * 4;
+				uint8_t expected[4] = { c[2], c[1], c[0], 0xff };
+				same = same && !memcmp(rgba->pixels + j * 4, expected, 4);
+			}
+			TEST_ASSERT(same);
+			cg_free(rgba);
+		}
+		cg_free(cg);
+		free(data);
+		free(px);
+	}
+}
+
+static void test_gp8_truncated(void)
+{
+	// seven literals, then a reference cut short
+	const uint8_t stream[] = { 0x7f, 1, 2, 3, 4, 5, 6, 7, 0x00 };
+	uint8_t data[8 + 256 * 4 + sizeof(stream)] = {0};
+	memcpy(data + 8 + 256 * 4, stream, sizeof(stream));
+
+	// the image is complete before the dangling reference
+	le_put16(data, 4, 7);
+	le_put16(data, 6, 1);
+	struct cg *cg = cg_load(data, sizeof(data), CG_TYPE_GP8);
+	TEST_ASSERT(cg && !memcmp(cg->pixels, stream + 1, 7));
+	cg_free(cg);
+
+	// the image is missing a pixel
+	le_put16(data, 4, 8);
+	TEST_ASSERT(!cg_load(data, sizeof(data), CG_TYPE_GP8));
+}
+
+int main(void)
+{
+	test_gxx(16, CG_TYPE_G16);
+	test_gxx(24, CG_TYPE_G24);
+	test_gxx(32, CG_TYPE_G32);
+	test_gxx_write(16, CG_TYPE_G16);
+	test_gxx_write(24, CG_TYPE_G24);
+	test_gxx_write(32, CG_TYPE_G32);
+	test_gp8();
+	test_gp8_truncated();
+	return test_finish("cg");
+}
@@ -0,0 +1,131 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Pixel conversion tests: every SIMD kernel supported by the CPU must produce
+ * the same output as the scalar code. Buffers are allocated at their exact
+ * size, so that reads or writes past the end of a row show up under ASan.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nulib.h"
+#include "cg/convert.h"
+#include "test.h"
+
+typedef void (*row_fn)(const uint8_t *px, uint8_t *out, unsigned w);
+
+static const struct {
+	const char *name;
+	size_t offset;
+	unsigned in_bpp;
+	unsigned out_bpp;
+} row_ops[] = {
+	{ "bgr555_to_rgba", offsetof(struct cg_convert_ops, bgr555_to_rgba), 2, 4 },
+	{ "bgr_to_rgba",    offsetof(struct cg_convert_ops, bgr_to_rgba),    3, 4 },
+	{ "bgra_to_rgba",   offsetof(struct cg_convert_ops, bgra_to_rgba),   4, 4 },
+	{ "rgba_to_bgr555", offsetof(struct cg_convert_ops, rgba_to_bgr555), 4, 2 },
+	{ "rgba_to_bgr",    offsetof(struct cg_convert_ops, rgba_to_bgr),    4, 3 },
+	{ "rgba_to_bgra",   offsetof(struct cg_convert_ops, rgba_to_bgra),   4, 4 },
+};
+
+static const unsigned isa_levels[] = {
+	CG_CONVERT_SSE2,
+	CG_CONVERT_SSE2 | CG_CONVERT_SSSE3,
+	CG_CONVERT_ALL,
+};
+
+static row_fn get_row_fn(const struct cg_convert_ops *ops, unsigned i)
+{
+	return *(row_fn*)((const uint8_t*)ops + row_ops[i].offset);
+}
+
+static void fill(uint8_t *buf, size_t size, bool saturated)
+{
+	for (size_t i = 0; i < size; i++) {
+		buf[i] = saturated ? (test_rand() & 1 ? 0xff : 0) : test_rand();
+	}
+}
+
+static void test_rows(void)
+{
+	struct cg_convert_ops scalar;
+	cg_convert_select(&scalar, 0);
+	for (unsigned level = 0; level < ARRAY_SIZE(isa_levels); level++) {
+		struct cg_convert_ops ops;
+		cg_convert_select(&ops, isa_levels[level]);
+		for (unsigned op = 0; op < ARRAY_SIZE(row_ops); op++) {
+			row_fn ref = get_row_fn(&scalar, op);
+			row_fn fn = get_row_fn(&ops, op);
+			for (unsigned w = 0; w < 2000; w += 1 + (w >= 100) * test_rand() % 16) {
+				size_t in_size = (size_t)w * row_ops[op].in_bpp;
+				size_t out_size = (size_t)w * row_ops[op].out_bpp;
+				uint8_t *in = xmalloc(in_size + 1);
+				uint8_t *expected = xmalloc(out_size + 1);
+				uint8_t *out = xmalloc(out_size + 1);
+				fill(in, in_size, w % 3 == 0);
+				ref(in, expected, w);
+				fn(in, out, w);
+				if (memcmp(out, expected, out_size)) {
+					fprintf(stderr, "%s (isa %u) differs at width %u\n",
+							row_ops[op].name, isa_levels[level], w);
+					TEST_ASSERT(false);
+				}
+				free(in);
+				free(expected);
+				free(out);
+			}
+		}
+	}
+}
+
+static void test_index_to_rgba(void)
+{
+	struct cg_convert_ops scalar, ops;
+	cg_convert_select(&scalar, 0);
+	cg_convert_select(&ops, CG_CONVERT_ALL);
+	uint32_t lut[256];
+	for (unsigned i = 0; i < 256; i++) {
+		lut[i] = test_rand();
+	}
+	for (unsigned i = 0; i < 5000; i++) {
+		size_t n = test_rand() % 5000;
+		uint8_t *px = xmalloc(n + 1);
+		uint8_t *expected = xmalloc(n * 4 + 1);
+		uint8_t *out = xmalloc(n * 4 + 1);
+		fill(px, n, false);
+		scalar.index_to_rgba(px, expected, n, lut);
+		ops.index_to_rgba(px, out, n, lut);
+		TEST_ASSERT(!memcmp(out, expected, n * 4));
+		// and the scalar code against the table itself
+		for (size_t j = 0; j < n; j++) {
+			TEST_ASSERT(!memcmp(expected + j * 4, &lut[px[j]], 4));
+		}
+		free(px);
+		free(expected);
+		free(out);
+	}
+}
+
+int main(void)
+{
+	test_rows();
+	test_index_to_rgba();
+	return test_finish("convert");
+}
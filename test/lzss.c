@@ -0,0 +1,159 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * LZSS tests: the decoders must produce output identical to nulib's
+ * `lzss_decompress`, and data compressed at any level must round trip.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nulib.h"
+#include "nulib/lzss.h"
+#include "ai5/lzss.h"
+#include "test.h"
+
+/*
+ * Check that a stream decodes to the same bytes as with nulib, with each of
+ * the decoders.
+ */
+static void check_stream(uint8_t *in, size_t in_size)
+{
+	size_t ref_size;
+	uint8_t *ref = lzss_decompress(in, in_size, &ref_size);
+	TEST_ASSERT(ref);
+
+	// into a buffer of exactly the right size
+	uint8_t *out = xmalloc(ref_size + 1);
+	size_t out_len;
+	enum ai5_lzss_status status = ai5_lzss_decompress_into(in, in_size, out, ref_size,
+			&out_len);
+	TEST_ASSERT(status == AI5_LZSS_OK || status == AI5_LZSS_TRUNCATED);
+	TEST_ASSERT(out_len == ref_size);
+	TEST_ASSERT(!memcmp(out, ref, ref_size));
+
+	// with an allocated buffer
+	size_t size;
+	uint8_t *buf = ai5_lzss_decompress(in, in_size, &size);
+	TEST_ASSERT(buf);
+	TEST_ASSERT(size == ref_size);
+	TEST_ASSERT(!memcmp(buf, ref, ref_size));
+	free(buf);
+
+	// incrementally, in pieces of random size, keeping only the history
+	// and the current piece in the buffer
+	size_t buf_size = 4096 + 1024 + AI5_LZSS_DECODE_SLACK;
+	buf = xmalloc(buf_size);
+	struct ai5_lzss_decoder d;
+	ai5_lzss_decoder_init(&d, in, in_size);
+	size_t len = 0, total = 0;
+	for (;;) {
+		if (len > 4096) {
+			memmove(buf, buf + len - 4096, 4096);
+			len = 4096;
+		}
+		size_t n = ai5_lzss_decode(&d, buf, len, 1 + test_rand() % 1024);
+		if (!n)
+			break;
+		TEST_ASSERT(total + n <= ref_size);
+		TEST_ASSERT(!memcmp(buf + len, ref + total, n));
+		len += n;
+		total += n;
+	}
+	TEST_ASSERT(total == ref_size);
+	TEST_ASSERT(d.truncated == (status == AI5_LZSS_TRUNCATED));
+
+	free(buf);
+	free(out);
+	free(ref);
+}
+
+static void test_round_trip(void)
+{
+	for (int i = 0; i < 300; i++) {
+		size_t size;
+		uint8_t *data = test_data(i % 30 == 0 ? 1 << 20 : 20000, &size);
+		int level = 1 + i % AI5_LZSS_MAX_LEVEL;
+
+		size_t in_size;
+		uint8_t *in = ai5_lzss_compress(data, size, &in_size, level);
+		check_stream(in, in_size);
+
+		size_t out_size;
+		uint8_t *out = ai5_lzss_decompress(in, in_size, &out_size);
+		TEST_ASSERT(out && out_size == size && !memcmp(out, data, size));
+		free(out);
+		free(in);
+
+		in = ai5_lzss_compress_mt(data, size, &in_size, level, 4);
+		out = ai5_lzss_decompress(in, in_size, &out_size);
+		TEST_ASSERT(out && out_size == size && !memcmp(out, data, size));
+		free(out);
+		free(in);
+		free(data);
+	}
+}
+
+static void test_random_streams(void)
+{
+	// arbitrary input is a valid stream too, with references reaching back
+	// before the start of the output
+	for (int i = 0; i < 3000; i++) {
+		size_t size = 1 + test_rand() % 5000;
+		uint8_t *in = xmalloc(size + 1);
+		for (size_t j = 0; j < size; j++) {
+			in[j] = test_rand();
+		}
+		check_stream(in, size);
+		free(in);
+	}
+}
+
+static void test_truncated(void)
+{
+	// a flag byte with all references, the second of which is cut short
+	uint8_t in[] = { 0x00, 0x01, 0x02, 0x03 };
+	size_t size;
+	uint8_t *buf = ai5_lzss_decompress(in, 3, &size);
+	TEST_ASSERT(buf && size == 5);
+	free(buf);
+	// the incomplete reference is ignored, as with nulib
+	buf = ai5_lzss_decompress(in, 4, &size);
+	TEST_ASSERT(buf && size == 5);
+	free(buf);
+
+	uint8_t out[64];
+	size_t out_len;
+	TEST_ASSERT(ai5_lzss_decompress_into(in, 3, out, 5, &out_len) == AI5_LZSS_OK);
+	TEST_ASSERT(ai5_lzss_decompress_into(in, 4, out, 64, &out_len) == AI5_LZSS_TRUNCATED);
+	TEST_ASSERT(out_len == 5);
+
+	// running out of input at a literal or flag byte is the normal end
+	uint8_t lit[] = { 0xff, 'a', 'b' };
+	TEST_ASSERT(ai5_lzss_decompress_into(lit, 3, out, 2, &out_len) == AI5_LZSS_OK);
+	TEST_ASSERT(ai5_lzss_decompress_into(lit, 3, out, 3, &out_len) == AI5_LZSS_UNDERRUN);
+	TEST_ASSERT(ai5_lzss_decompress_into(lit, 3, out, 1, &out_len) == AI5_LZSS_OVERRUN);
+}
+
+int main(void)
+{
+	test_round_trip();
+	test_random_streams();
+	test_truncated();
+	return test_finish("lzss");
+}
@@ -0,0 +1,128 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef AI5_TEST_H
+#define AI5_TEST_H
+
+/*
+ * Helpers shared by the tests and benchmarks. Each test is a program which
+ * exits with a non-zero status if any assertion failed.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "nulib.h"
+
+static unsigned test_failures;
+
+#define TEST_ASSERT(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #cond); \
+			if (++test_failures >= 10) \
+				exit(1); \
+		} \
+	} while (0)
+
+static inline int test_finish(const char *name)
+{
+	if (test_failures) {
+		fprintf(stderr, "%s: %u failures\n", name, test_failures);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Deterministic pseudo-random numbers (xorshift32), so that failures can be
+ * reproduced.
+ */
+static uint32_t test_rand_state = 2463534242u;
+
+static inline uint32_t test_rand(void)
+{
+	uint32_t x = test_rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return test_rand_state = x;
+}
+
+/*
+ * Fill a buffer with something resembling script source.
+ */
+static inline void test_fill_text(uint8_t *data, size_t size)
+{
+	static const char *words[] = { "SET ", "JUMP ", "CALL ", "0x", "VAR[", "]", "\n",
+		"TEXT \"", "\" ", "IF ", "ELSE ", "12", "345" };
+	for (size_t i = 0; i < size;) {
+		const char *w = words[test_rand() % ARRAY_SIZE(words)];
+		for (; *w && i < size; w++)
+			data[i++] = *w;
+	}
+}
+
+static inline uint8_t *test_text(size_t size, size_t *size_out)
+{
+	uint8_t *data = xmalloc(size + 1);
+	test_fill_text(data, size);
+	*size_out = size;
+	return data;
+}
+
+/*
+ * Generate up to `max` bytes of test data, alternating between noise, runs of
+ * a few values, image-like gradients and text-like data.
+ */
+static inline uint8_t *test_data(size_t max, size_t *size_out)
+{
+	size_t size = test_rand() % (max + 1);
+	uint8_t *data = xmalloc(size + 1);
+	switch (test_rand() % 4) {
+	case 0:
+		for (size_t i = 0; i < size; i++)
+			data[i] = test_rand();
+		break;
+	case 1:
+		for (size_t i = 0; i < size; i++)
+			data[i] = test_rand() % 4;
+		break;
+	case 2: {
+		unsigned w = 1 + test_rand() % 640;
+		for (size_t i = 0; i < size; i++)
+			data[i] = (i % w) / 3 + (i / w) + (test_rand() % 8 == 0);
+		break;
+	}
+	case 3:
+		test_fill_text(data, size);
+		break;
+	}
+	*size_out = size;
+	return data;
+}
+
+static inline uint64_t test_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#endif // AI5_TEST_H